@@ -0,0 +1,206 @@
+/*
+ * This file is part of lem-ssl.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-ssl is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-ssl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * hash table with string keys, which evicts the least
+ * recently used entry when it grows beyond max entries
+ */
+static void
+cache_init(struct lem_ssl_cache *c, unsigned int max,
+           void (*free)(void *value))
+{
+	c->buckets = NULL;
+	c->nbuckets = 0;
+	c->n = 0;
+	c->max = max;
+	c->free = free;
+	c->newest = c->oldest = NULL;
+}
+
+static unsigned int
+cache_hash(const char *key)
+{
+	unsigned int h = 2166136261U;
+
+	while (*key)
+		h = (h ^ (unsigned char)*key++) * 16777619U;
+
+	return h;
+}
+
+static struct lem_ssl_entry **
+cache_slot(struct lem_ssl_cache *c, const char *key)
+{
+	struct lem_ssl_entry **p;
+
+	p = &c->buckets[cache_hash(key) & (c->nbuckets - 1)];
+	while (*p != NULL && strcmp((*p)->key, key) != 0)
+		p = &(*p)->next;
+
+	return p;
+}
+
+static void
+cache_unlink(struct lem_ssl_cache *c, struct lem_ssl_entry *e)
+{
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		c->newest = e->older;
+
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		c->oldest = e->newer;
+}
+
+static void
+cache_link(struct lem_ssl_cache *c, struct lem_ssl_entry *e)
+{
+	e->newer = NULL;
+	e->older = c->newest;
+	if (c->newest)
+		c->newest->newer = e;
+	else
+		c->oldest = e;
+	c->newest = e;
+}
+
+static void
+cache_drop(struct lem_ssl_cache *c, struct lem_ssl_entry *e)
+{
+	struct lem_ssl_entry **p = cache_slot(c, e->key);
+
+	*p = e->next;
+	cache_unlink(c, e);
+	c->n--;
+	if (c->free)
+		c->free(e->value);
+	free(e);
+}
+
+static void *
+cache_get(struct lem_ssl_cache *c, const char *key)
+{
+	struct lem_ssl_entry *e;
+
+	if (c->n == 0)
+		return NULL;
+
+	e = *cache_slot(c, key);
+	if (e == NULL)
+		return NULL;
+
+	if (c->newest != e) {
+		cache_unlink(c, e);
+		cache_link(c, e);
+	}
+	return e->value;
+}
+
+static void
+cache_remove(struct lem_ssl_cache *c, const char *key)
+{
+	struct lem_ssl_entry *e;
+
+	if (c->n == 0)
+		return;
+
+	e = *cache_slot(c, key);
+	if (e != NULL)
+		cache_drop(c, e);
+}
+
+static int
+cache_grow(struct lem_ssl_cache *c)
+{
+	unsigned int nbuckets = c->nbuckets ? 2 * c->nbuckets : 16;
+	struct lem_ssl_entry **buckets;
+	struct lem_ssl_entry *e;
+
+	buckets = calloc(nbuckets, sizeof(struct lem_ssl_entry *));
+	if (buckets == NULL)
+		return -1;
+
+	free(c->buckets);
+	c->buckets = buckets;
+	c->nbuckets = nbuckets;
+	for (e = c->oldest; e != NULL; e = e->newer) {
+		struct lem_ssl_entry **p =
+			&buckets[cache_hash(e->key) & (nbuckets - 1)];
+
+		e->next = *p;
+		*p = e;
+	}
+
+	return 0;
+}
+
+/*
+ * insert or replace the value stored under key
+ * returns -1 if out of memory
+ */
+static int
+cache_put(struct lem_ssl_cache *c, const char *key, void *value)
+{
+	struct lem_ssl_entry **p;
+	struct lem_ssl_entry *e;
+	size_t len;
+
+	if (c->n >= c->nbuckets && cache_grow(c))
+		return -1;
+
+	p = cache_slot(c, key);
+	e = *p;
+	if (e != NULL) {
+		if (c->free && e->value != value)
+			c->free(e->value);
+		e->value = value;
+		cache_unlink(c, e);
+		cache_link(c, e);
+		return 0;
+	}
+
+	len = strlen(key) + 1;
+	e = malloc(sizeof(struct lem_ssl_entry) + len);
+	if (e == NULL)
+		return -1;
+
+	memcpy(e->key, key, len);
+	e->value = value;
+	e->next = NULL;
+	*p = e;
+	cache_link(c, e);
+	c->n++;
+
+	while (c->max > 0 && c->n > c->max)
+		cache_drop(c, c->oldest);
+
+	return 0;
+}
+
+static void
+cache_free(struct lem_ssl_cache *c)
+{
+	while (c->oldest != NULL)
+		cache_drop(c, c->oldest);
+
+	free(c->buckets);
+	c->buckets = NULL;
+	c->nbuckets = 0;
+}
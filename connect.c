@@ -0,0 +1,563 @@
+/*
+ * This file is part of lem-ssl.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-ssl is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-ssl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+static void batch_done(struct lem_ssl_stream *s, int ret);
+
+static void
+connect_done(struct lem_ssl_stream *s, int ret)
+{
+	if (s->connect.batch != NULL) {
+		batch_done(s, ret);
+		return;
+	}
+
+	lem_queue(s->T, ret);
+	s->T = NULL;
+}
+
+static void
+connect_handler(EV_P_ struct ev_io *w, int revents)
+{
+	struct lem_ssl_stream *s = (struct lem_ssl_stream *)w;
+	int ret;
+
+	(void)revents;
+
+	ret = stream_check_error(s->T, s, SSL_connect(s->ssl),
+	                         "error establishing SSL connection: %s");
+	if (ret == 0)
+		return;
+
+	stream_io_unregister(s);
+	connect_done(s, ret);
+}
+
+/*
+ * race TCP connections to all addresses of a host
+ * and hand the first one to connect to SSL_connect()
+ */
+static void
+attempt_stop(struct lem_ssl_attempt *a)
+{
+	ev_io_stop(EV_G_ &a->w);
+	ev_timer_stop(EV_G_ &a->timeout);
+	close(a->w.fd);
+	a->w.fd = -1;
+	a->c->running--;
+}
+
+/*
+ * look up the addresses of a host
+ */
+static void
+lookup_unref(void *arg)
+{
+	struct lem_ssl_lookup *l = arg;
+
+	if (--l->refs > 0)
+		return;
+
+	if (l->res != NULL)
+		freeaddrinfo(l->res);
+	free(l);
+}
+
+/*
+ * return a reference to the addresses of host and port, and
+ * with a cache only look up each host and port once, since
+ * getaddrinfo() blocks the event loop
+ * returns NULL if out of memory
+ */
+static struct lem_ssl_lookup *
+lookup_get(struct lem_ssl_cache *cache, const char *host, const char *port)
+{
+	struct addrinfo hints;
+	struct lem_ssl_lookup *l;
+	char key[NI_MAXHOST + 32];
+	int len = -1;
+
+	if (cache != NULL) {
+		len = snprintf(key, sizeof(key), "%s %s", host, port);
+		if (len >= 0 && (size_t)len < sizeof(key) &&
+		    (l = cache_get(cache, key)) != NULL) {
+			lem_debug("already looked up %s", key);
+			l->refs++;
+			return l;
+		}
+	}
+
+	l = malloc(sizeof(struct lem_ssl_lookup));
+	if (l == NULL)
+		return NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	l->refs = 1;
+	l->res = NULL;
+	l->err = getaddrinfo(host, port, &hints, &l->res);
+
+	/* the cache holds a reference of its own */
+	if (len >= 0 && (size_t)len < sizeof(key) &&
+	    cache_put(cache, key, l) == 0)
+		l->refs++;
+
+	return l;
+}
+
+static void
+connector_free(struct lem_ssl_connector *c)
+{
+	int i;
+
+	ev_timer_stop(EV_G_ &c->delay);
+	for (i = 0; i < c->started; i++) {
+		if (c->a[i].w.fd >= 0)
+			attempt_stop(&c->a[i]);
+	}
+
+	lookup_unref(c->lookup);
+	free(c);
+}
+
+static void attempt_handler(EV_P_ struct ev_io *w, int revents);
+static void attempt_timeout(EV_P_ struct ev_timer *w, int revents);
+
+/*
+ * start connecting to the next address
+ * returns 0 on success and -1 if there are no more
+ * addresses to try
+ */
+static int
+attempt_start(struct lem_ssl_connector *c)
+{
+	while (c->started < c->n) {
+		struct lem_ssl_attempt *a = &c->a[c->started++];
+		int fd;
+
+		fd = socket(a->ai->ai_family, a->ai->ai_socktype,
+		            a->ai->ai_protocol);
+		if (fd < 0) {
+			c->err = errno;
+			continue;
+		}
+
+		if (fcntl(fd, F_SETFD, FD_CLOEXEC) ||
+		    fcntl(fd, F_SETFL, O_NONBLOCK) ||
+		    (connect(fd, a->ai->ai_addr, a->ai->ai_addrlen) &&
+		     errno != EINPROGRESS)) {
+			c->err = errno;
+			close(fd);
+			continue;
+		}
+
+		lem_debug("attempt %d started", c->started);
+		ev_io_init(&a->w, attempt_handler, fd, EV_WRITE);
+		ev_io_start(EV_G_ &a->w);
+		ev_timer_init(&a->timeout, attempt_timeout,
+		              LEM_SSL_CONNECT_TIMEOUT, 0);
+		ev_timer_start(EV_G_ &a->timeout);
+		c->running++;
+
+		/* give this attempt a head start before the next */
+		ev_timer_stop(EV_G_ &c->delay);
+		if (c->started < c->n) {
+			ev_timer_set(&c->delay, LEM_SSL_CONNECT_DELAY, 0);
+			ev_timer_start(EV_G_ &c->delay);
+		}
+		return 0;
+	}
+
+	return -1;
+}
+
+static void
+attempt_failed(struct lem_ssl_attempt *a, int err)
+{
+	struct lem_ssl_connector *c = a->c;
+	struct lem_ssl_stream *s = c->s;
+
+	lem_debug("attempt failed: %s", strerror(err));
+	attempt_stop(a);
+	c->err = err;
+
+	/* don't wait for the delay when an attempt fails */
+	if (attempt_start(c) == 0 || c->running > 0)
+		return;
+
+	lua_pushnil(s->T);
+	lua_pushfstring(s->T, "error connecting: %s", strerror(c->err));
+	SSL_free(c->ssl);
+	connector_free(c);
+	connect_done(s, 2);
+}
+
+static void
+attempt_handler(EV_P_ struct ev_io *w, int revents)
+{
+	struct lem_ssl_attempt *a = (struct lem_ssl_attempt *)w;
+	struct lem_ssl_connector *c = a->c;
+	struct lem_ssl_stream *s = c->s;
+	int err;
+	socklen_t len = sizeof(err);
+	int fd;
+	BIO *bio;
+
+	(void)revents;
+
+	if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+		err = errno;
+	if (err) {
+		attempt_failed(a, err);
+		return;
+	}
+
+	/* we have a winner, cancel everyone else */
+	lem_debug("connected");
+	stream_trace(s, LEM_SSL_TRACE_TCP, 0);
+	fd = w->fd;
+	ev_io_stop(EV_G_ &a->w);
+	ev_timer_stop(EV_G_ &a->timeout);
+	a->w.fd = -1;
+	a->c->running--;
+
+	bio = BIO_new_socket(fd, BIO_CLOSE);
+	if (bio == NULL) {
+		close(fd);
+		lua_pushnil(s->T);
+		lua_pushfstring(s->T, "error creating BIO: %s",
+		                ERR_reason_error_string(ERR_get_error()));
+		SSL_free(c->ssl);
+		connector_free(c);
+		connect_done(s, 2);
+		return;
+	}
+
+	stream_set_bio(s, c->ssl, bio);
+	s->ssl = c->ssl;
+	ev_io_set(&s->w, fd, 0);
+	ev_io_set(&s->wr.w, fd, 0);
+	connector_free(c);
+
+	connect_handler(EV_G_ &s->w, 0);
+}
+
+static void
+attempt_timeout(EV_P_ struct ev_timer *w, int revents)
+{
+	struct lem_ssl_attempt *a = (struct lem_ssl_attempt *)
+		((char *)w - offsetof(struct lem_ssl_attempt, timeout));
+
+	(void)revents;
+
+	attempt_failed(a, ETIMEDOUT);
+}
+
+static void
+connector_delay(EV_P_ struct ev_timer *w, int revents)
+{
+	(void)revents;
+
+	attempt_start((struct lem_ssl_connector *)w);
+}
+
+static struct addrinfo *
+next_family(struct addrinfo *ai, int family, int same)
+{
+	for (; ai != NULL; ai = ai->ai_next) {
+		if ((ai->ai_family == family) == same)
+			break;
+	}
+
+	return ai;
+}
+
+/*
+ * split "host:port" or "[host]:port" into host and port
+ * returns -1 if the host part doesn't fit in the buffer
+ */
+static int
+address_split(const char *address, char *host, size_t size,
+              const char **port)
+{
+	const char *end;
+
+	if (address[0] == '[' && (end = strchr(address, ']')) != NULL) {
+		address++;
+		*port = end[1] == ':' ? end + 2 : NULL;
+	} else {
+		end = strchr(address, ':');
+		if (end == NULL || strchr(end + 1, ':') != NULL) {
+			/* no port or a bare IPv6 address */
+			end = address + strlen(address);
+			*port = NULL;
+		} else
+			*port = end + 1;
+	}
+
+	if ((size_t)(end - address) >= size)
+		return -1;
+
+	memcpy(host, address, end - address);
+	host[end - address] = '\0';
+	return 0;
+}
+
+/*
+ * start connecting to the addresses of host
+ * returns 0 when the connection is under way and
+ * 2 with an error message on the stack otherwise
+ */
+static int
+connector_start(lua_State *T, struct lem_ssl_stream *s, SSL *ssl,
+                const char *host, struct lem_ssl_lookup *l)
+{
+	struct addrinfo *res = l->res;
+	struct addrinfo *ai;
+	struct addrinfo *p;
+	struct addrinfo *q;
+	struct lem_ssl_connector *c;
+	int n;
+	int i;
+
+	if (l->err) {
+		lua_pushnil(T);
+		lua_pushfstring(T, "error looking up '%s': %s",
+		                host, gai_strerror(l->err));
+		return 2;
+	}
+
+	n = 0;
+	for (ai = res; ai != NULL; ai = ai->ai_next)
+		n++;
+	stream_trace(s, LEM_SSL_TRACE_RESOLVED, n);
+
+	c = malloc(sizeof(struct lem_ssl_connector) +
+	           n * sizeof(struct lem_ssl_attempt));
+	if (c == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "out of memory");
+		return 2;
+	}
+
+	ev_timer_init(&c->delay, connector_delay, LEM_SSL_CONNECT_DELAY, 0);
+	c->s = s;
+	c->ssl = ssl;
+	c->lookup = l;
+	l->refs++;
+	c->n = n;
+	c->started = 0;
+	c->running = 0;
+	c->err = 0;
+
+	/* alternate between address families, RFC 8305 section 4 */
+	p = res;
+	q = next_family(res, res->ai_family, 0);
+	for (i = 0; i < n; i++) {
+		struct lem_ssl_attempt *a = &c->a[i];
+
+		if ((i % 2 == 0 && p != NULL) || q == NULL) {
+			a->ai = p;
+			p = next_family(p->ai_next, res->ai_family, 1);
+		} else {
+			a->ai = q;
+			q = next_family(q->ai_next, res->ai_family, 0);
+		}
+		a->c = c;
+		a->w.fd = -1;
+	}
+
+	if (attempt_start(c)) {
+		lua_pushnil(T);
+		lua_pushfstring(T, "error connecting: %s", strerror(c->err));
+		connector_free(c);
+		return 2;
+	}
+
+	return 0;
+}
+
+static int
+address_numeric(const char *host)
+{
+	struct in6_addr addr;
+
+	return inet_pton(AF_INET, host, &addr) == 1 ||
+	       inet_pton(AF_INET6, host, &addr) == 1;
+}
+
+/*
+ * start connecting a stream to host and port, looking
+ * them up through the cache lookups unless it's NULL
+ * returns 0 when the connection is under way and
+ * 2 with an error message on the stack otherwise
+ */
+static int
+connect_start(lua_State *T, struct lem_ssl_context *c,
+              struct lem_ssl_stream *s, const char *host, const char *port,
+              struct lem_ssl_cache *lookups)
+{
+	struct lem_ssl_lookup *l;
+	SSL *ssl;
+	int ret;
+
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	if (port == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "no port specified");
+		return 2;
+	}
+
+	ssl = SSL_new(c->ctx);
+	if (ssl == NULL) {
+		lua_pushnil(T);
+		lua_pushfstring(T, "error creating SSL connection: %s",
+		                ERR_reason_error_string(ERR_get_error()));
+		return 2;
+	}
+
+	if (c->trace != NULL) {
+		trace_attach(s, ssl, c->trace);
+		stream_trace(s, LEM_SSL_TRACE_CONNECT, 0);
+	}
+
+	/* tell servers with many certificates which one we want,
+	 * and check that we got it when verifying certificates */
+	if (address_numeric(host)) {
+		if (c->verify != NULL)
+			X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+	} else {
+		SSL_set_tlsext_host_name(ssl, host);
+		if (c->verify != NULL)
+			SSL_set1_host(ssl, host);
+	}
+
+	l = lookup_get(lookups, host, port);
+	if (l == NULL) {
+		SSL_free(ssl);
+		lua_pushnil(T);
+		lua_pushliteral(T, "out of memory");
+		return 2;
+	}
+
+	ret = connector_start(T, s, ssl, host, l);
+	lookup_unref(l);
+	if (ret)
+		SSL_free(ssl);
+
+	return ret;
+}
+
+/*
+ * connect to a batch of addresses
+ *
+ * while running the stack of the batch coroutine holds
+ * 1: context, 2: addresses, 3: streams and 4: errors
+ */
+static void
+batch_error(struct lem_ssl_batch *b, int i)
+{
+	lua_State *T = b->T;
+
+	/* errors[i] = msg, streams[i] = nil */
+	lua_rawseti(T, 4, i);
+	lua_pop(T, 1);
+	lua_pushnil(T);
+	lua_rawseti(T, 3, i);
+}
+
+static int
+batch_start(struct lem_ssl_batch *b, int i)
+{
+	lua_State *T = b->T;
+	struct lem_ssl_stream *s;
+	char host[NI_MAXHOST];
+	const char *port;
+	int ret;
+
+	lua_rawgeti(T, 3, i);
+	s = lua_touserdata(T, -1);
+	lua_pop(T, 1);
+
+	lua_rawgeti(T, 2, i);
+	if (address_split(lua_tostring(T, -1), host, sizeof(host), &port)) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "invalid address");
+		ret = 2;
+	} else
+		ret = connect_start(T, b->c, s, host, port, &b->lookups);
+
+	lua_remove(T, -1 - ret);
+	if (ret) {
+		batch_error(b, i);
+		return ret;
+	}
+
+	s->T = T;
+	s->connect.batch = b;
+	s->connect.index = i;
+	b->running++;
+	return 0;
+}
+
+/*
+ * start as many connections as allowed
+ * returns 1 when the whole batch is done
+ */
+static int
+batch_next(struct lem_ssl_batch *b)
+{
+	while (b->next <= b->n &&
+	       (b->concurrency == 0 || b->running < b->concurrency))
+		batch_start(b, b->next++);
+
+	if (b->running > 0 || b->next <= b->n)
+		return 0;
+
+	lua_settop(b->T, 4);
+	cache_free(&b->lookups);
+	free(b);
+	return 1;
+}
+
+static void
+batch_done(struct lem_ssl_stream *s, int ret)
+{
+	struct lem_ssl_batch *b = s->connect.batch;
+	lua_State *T = b->T;
+	int i = s->connect.index;
+
+	lem_debug("connection %d done", i);
+	s->connect.batch = NULL;
+	s->T = NULL;
+	if (ret == 2)
+		batch_error(b, i);
+
+	b->running--;
+	if (batch_next(b)) {
+		lua_pushvalue(T, 3);
+		lua_pushvalue(T, 4);
+		lem_queue(T, 2);
+	}
+}
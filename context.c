@@ -16,6 +16,69 @@
  * along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* index of the struct lem_ssl_context in SSL_CTX ex_data */
+static int context_index;
+
+static struct lem_ssl_context *
+context_get(SSL *ssl)
+{
+	return SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), context_index);
+}
+
+static void
+tickets_free(struct lem_ssl_tickets *t)
+{
+	ev_timer_stop(EV_G_ &t->w);
+	OPENSSL_cleanse(t->keys, sizeof(t->keys));
+	free(t->path);
+	free(t);
+}
+
+static void
+hosts_free(struct lem_ssl_hosts *hosts)
+{
+	cache_free(&hosts->index);
+	cache_free(&hosts->loaded);
+	free(hosts);
+}
+
+static void
+staples_free(struct lem_ssl_cache *staples)
+{
+	cache_free(staples);
+	free(staples);
+}
+
+static void
+verify_free(struct lem_ssl_verify *v)
+{
+	cache_free(&v->results);
+	free(v);
+}
+
+static void
+context_untrace(struct lem_ssl_context *c)
+{
+	struct lem_ssl_trace *t = c->trace;
+
+	/* streams may still hold on to the buffer */
+	t->enabled = 0;
+	trace_unref(t);
+	c->trace = NULL;
+}
+
+/*
+ * only pay for the info callback when
+ * somebody is going to look at the results
+ */
+static void
+context_info(struct lem_ssl_context *c)
+{
+	SSL_CTX_set_info_callback(c->ctx,
+	                          (c->trace != NULL || c->hsstats) ?
+	                          stream_info_cb : NULL);
+}
+
 static int
 context_close(lua_State *T)
 {
@@ -30,6 +93,33 @@ context_close(lua_State *T)
 		return 2;
 	}
 
+	/* servers and streams may keep the SSL_CTX
+	 * alive, so make sure they forget about us */
+	SSL_CTX_set_ex_data(c->ctx, context_index, NULL);
+
+	if (c->tickets != NULL) {
+		tickets_free(c->tickets);
+		c->tickets = NULL;
+	}
+
+	if (c->hosts != NULL) {
+		hosts_free(c->hosts);
+		c->hosts = NULL;
+	}
+
+	if (c->staples != NULL) {
+		staples_free(c->staples);
+		c->staples = NULL;
+	}
+
+	if (c->verify != NULL) {
+		verify_free(c->verify);
+		c->verify = NULL;
+	}
+
+	if (c->trace != NULL)
+		context_untrace(c);
+
 	SSL_CTX_free(c->ctx);
 	c->ctx = NULL;
 
@@ -57,44 +147,90 @@ context_new(lua_State *T)
 	lua_setmetatable(T, -2);
 
 	c->ctx = ctx;
+	c->tickets = NULL;
+	c->hosts = NULL;
+	c->staples = NULL;
+	c->verify = NULL;
+	c->trace = NULL;
+	c->hsstats = 0;
+	SSL_CTX_set_ex_data(ctx, context_index, c);
 
 	return 1;
 }
 
-static void
-connect_handler(EV_P_ struct ev_io *w, int revents)
+static int
+context_readahead(lua_State *T)
 {
-	struct lem_ssl_stream *s = (struct lem_ssl_stream *)w;
-	int ret;
+	struct lem_ssl_context *c;
+	lua_Number size;
 
-	(void)revents;
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	size = luaL_optnumber(T, 2, LEM_SSL_READ_AHEAD);
+	luaL_argcheck(T, size >= 0 && size <= INT_MAX, 2, "invalid size");
 
-	ret = stream_check_error(s->T, s, SSL_connect(s->ssl),
-	                         "error establishing SSL connection: %s");
-	if (ret == 0)
-		return;
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	if (size == 0)
+		SSL_CTX_set_read_ahead(c->ctx, 0);
+	else {
+		SSL_CTX_set_read_ahead(c->ctx, 1);
+		SSL_CTX_set_default_read_buffer_len(c->ctx, (size_t)size);
+	}
 
-	stream_io_unregister(s);
-	lem_queue(s->T, ret);
-	s->T = NULL;
+	lua_pushboolean(T, 1);
+	return 1;
 }
 
 static int
-context_connect(lua_State *T)
+context_ktls(lua_State *T)
 {
 	struct lem_ssl_context *c;
-	const char *hostname;
-	int port;
-	BIO *bio;
-	SSL *ssl;
-	int ret;
-	const char *msg;
-	struct lem_ssl_stream *s;
+	int enable;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	enable = lua_isnone(T, 2) || lua_toboolean(T, 2);
+
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+#ifdef LEM_SSL_KTLS
+	/* let stream:sendfile() use the kernel when possible */
+	if (enable)
+		SSL_CTX_set_options(c->ctx, SSL_OP_ENABLE_KTLS);
+	else
+		SSL_CTX_clear_options(c->ctx, SSL_OP_ENABLE_KTLS);
+#else
+	if (enable) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "kTLS not supported");
+		return 2;
+	}
+#endif
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+static int
+context_usecertificate(lua_State *T)
+{
+	struct lem_ssl_context *c;
+	const char *certfile;
+	const char *keyfile;
 
 	luaL_checktype(T, 1, LUA_TUSERDATA);
 	c = lua_touserdata(T, 1);
-	hostname = luaL_checkstring(T, 2);
-	port = (int)luaL_optnumber(T, 3, -1);
+	certfile = luaL_checkstring(T, 2);
+	keyfile = luaL_optstring(T, 3, certfile);
 
 	if (c->ctx == NULL) {
 		lua_pushnil(T);
@@ -102,86 +238,1181 @@ context_connect(lua_State *T)
 		return 2;
 	}
 
-	bio = BIO_new(BIO_s_connect());
-	if (bio == NULL) {
+	if (SSL_CTX_use_certificate_chain_file(c->ctx, certfile) != 1) {
 		lua_pushnil(T);
-		lua_pushfstring(T, "error creating BIO: %s",
+		lua_pushfstring(T, "error loading certificate: %s",
 		                ERR_reason_error_string(ERR_get_error()));
 		return 2;
 	}
-	BIO_set_conn_hostname(bio, hostname);
-	if (port > 0)
-		BIO_set_conn_int_port(bio, (char *)&port);
-	BIO_set_nbio(bio, 1);
 
-	ssl = SSL_new(c->ctx);
-	if (ssl == NULL) {
+	if (SSL_CTX_use_PrivateKey_file(c->ctx, keyfile,
+	                                SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(c->ctx) != 1) {
 		lua_pushnil(T);
-		lua_pushfstring(T, "error creating SSL connection: %s",
+		lua_pushfstring(T, "error loading private key: %s",
 		                ERR_reason_error_string(ERR_get_error()));
 		return 2;
 	}
-	SSL_set_bio(ssl, bio, bio);
 
-	ret = SSL_connect(ssl);
-	switch (SSL_get_error(ssl, ret)) {
-	case SSL_ERROR_NONE:
-		lem_debug("SSL_ERROR_NONE");
-		s = stream_new(T, ssl, NULL, 0);
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+static int
+context_listen(lua_State *T)
+{
+	struct lem_ssl_context *c;
+	const char *address;
+	char host[NI_MAXHOST];
+	const char *port;
+	char portbuf[16];
+	int backlog;
+	int reuseport;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	address = luaL_checkstring(T, 2);
+	if (address_split(address, host, sizeof(host), &port))
+		return luaL_argerror(T, 2, "invalid address");
+	if (!lua_isnoneornil(T, 3)) {
+		sprintf(portbuf, "%d", (int)luaL_checknumber(T, 3));
+		port = portbuf;
+	}
+	backlog = (int)luaL_optnumber(T, 4, LEM_SSL_LISTEN_BACKLOG);
+	reuseport = lua_toboolean(T, 5);
+
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	if (port == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "no port specified");
+		return 2;
+	}
+
+	return server_new(T, c->ctx, host, port, backlog, reuseport);
+}
+
+/*
+ * session ticket keys
+ *
+ * each key is 16 bytes of name, 32 bytes of HMAC secret
+ * and 32 bytes of AES key. the first key encrypts new
+ * tickets, the others are only accepted for decryption
+ */
+static int
+tickets_load(struct lem_ssl_tickets *t, const char *path, const char **msg)
+{
+	unsigned char keys[LEM_SSL_TICKET_KEYS][LEM_SSL_TICKET_KEYSIZE];
+	FILE *f;
+	size_t len;
+	int err;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		*msg = strerror(errno);
+		return -1;
+	}
+
+	len = fread(keys, 1, sizeof(keys), f);
+	err = ferror(f) ? errno : 0;
+	fclose(f);
+
+	if (err) {
+		*msg = strerror(err);
+		return -1;
+	}
+
+	if (len == 0 || len % LEM_SSL_TICKET_KEYSIZE) {
+		*msg = "invalid key file";
+		return -1;
+	}
+
+	memcpy(t->keys, keys, len);
+	t->n = len / LEM_SSL_TICKET_KEYSIZE;
+	OPENSSL_cleanse(keys, sizeof(keys));
+	return 0;
+}
+
+static void
+tickets_handler(EV_P_ struct ev_timer *w, int revents)
+{
+	struct lem_ssl_tickets *t = (struct lem_ssl_tickets *)w;
+	const char *msg;
+
+	(void)revents;
+
+	/* keep the old keys if something is wrong */
+	if (tickets_load(t, t->path, &msg)) {
+		lem_debug("error reloading '%s': %s", t->path, msg);
+	}
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define LEM_SSL_HMAC_CTX EVP_MAC_CTX
+
+static int
+ticket_hmac_init(EVP_MAC_CTX *hctx, const unsigned char *key)
+{
+	OSSL_PARAM params[2];
+
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+	                                             (char *)"SHA256", 0);
+	params[1] = OSSL_PARAM_construct_end();
+	return EVP_MAC_init(hctx, key, 32, params);
+}
+#else
+#define LEM_SSL_HMAC_CTX HMAC_CTX
+
+static int
+ticket_hmac_init(HMAC_CTX *hctx, const unsigned char *key)
+{
+	return HMAC_Init_ex(hctx, key, 32, EVP_sha256(), NULL);
+}
+#endif
+
+static int
+ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+              EVP_CIPHER_CTX *ectx, LEM_SSL_HMAC_CTX *hctx, int enc)
+{
+	struct lem_ssl_context *c = context_get(ssl);
+	struct lem_ssl_tickets *t;
+	const unsigned char *key;
+	int i;
+
+	if (c == NULL || (t = c->tickets) == NULL || t->n == 0)
+		return 0;
+
+	if (enc) {
+		key = t->keys[0];
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			return -1;
+
+		memcpy(name, key, 16);
+		if (EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+		                       key + 48, iv) != 1 ||
+		    ticket_hmac_init(hctx, key + 16) != 1)
+			return -1;
 		return 1;
+	}
+
+	for (i = 0; i < t->n; i++) {
+		if (memcmp(name, t->keys[i], 16) == 0)
+			break;
+	}
+	if (i == t->n) {
+		lem_debug("unknown ticket key");
+		return 0;
+	}
+
+	key = t->keys[i];
+	if (ticket_hmac_init(hctx, key + 16) != 1 ||
+	    EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+	                       key + 48, iv) != 1)
+		return -1;
+
+	/* ask for a new ticket if this key is old */
+	return i == 0 ? 1 : 2;
+}
+
+static int
+context_ticketkeys(lua_State *T)
+{
+	struct lem_ssl_context *c;
+	const char *path;
+	lua_Number interval;
+	struct lem_ssl_tickets *t;
+	const char *msg;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	path = luaL_checkstring(T, 2);
+	interval = luaL_optnumber(T, 3, 0);
+	luaL_argcheck(T, interval >= 0, 3, "invalid interval");
+
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	t = malloc(sizeof(struct lem_ssl_tickets));
+	if (t == NULL || (t->path = strdup(path)) == NULL) {
+		free(t);
+		lua_pushnil(T);
+		lua_pushliteral(T, "out of memory");
+		return 2;
+	}
+
+	if (tickets_load(t, path, &msg)) {
+		lua_pushnil(T);
+		lua_pushfstring(T, "error loading '%s': %s", path, msg);
+		free(t->path);
+		free(t);
+		return 2;
+	}
+
+	ev_timer_init(&t->w, tickets_handler, interval, interval);
+	if (interval > 0)
+		ev_timer_start(EV_G_ &t->w);
+
+	if (c->tickets != NULL)
+		tickets_free(c->tickets);
+	c->tickets = t;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(c->ctx, ticket_key_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(c->ctx, ticket_key_cb);
+#endif
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+static int
+context_connect(lua_State *T)
+{
+	struct lem_ssl_context *c;
+	const char *address;
+	char host[NI_MAXHOST];
+	const char *port;
+	char portbuf[16];
+	struct lem_ssl_stream *s;
+	int ret;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	address = luaL_checkstring(T, 2);
+	if (address_split(address, host, sizeof(host), &port))
+		return luaL_argerror(T, 2, "invalid address");
+	if (!lua_isnoneornil(T, 3)) {
+		sprintf(portbuf, "%d", (int)luaL_checknumber(T, 3));
+		port = portbuf;
+	}
+
+	s = stream_new(T, NULL, connect_handler, 0);
+	s->connect.batch = NULL;
+	ret = connect_start(T, c, s, host, port, NULL);
+	if (ret)
+		return ret;
+
+	/* only leave the stream on the stack */
+	lua_replace(T, 1);
+	lua_settop(T, 1);
+
+	s->T = T;
+	return lua_yield(T, 1);
+}
+
+static int
+context_connectmany(lua_State *T)
+{
+	struct lem_ssl_context *c;
+	struct lem_ssl_batch *b;
+	lua_Number concurrency;
+	int n;
+	int i;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	luaL_checktype(T, 2, LUA_TTABLE);
+	concurrency = luaL_optnumber(T, 3, 0);
+	luaL_argcheck(T, concurrency >= 0, 3, "invalid concurrency");
+
+	n = (int)lua_objlen(T, 2);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(T, 2, i);
+		if (lua_type(T, -1) != LUA_TSTRING)
+			return luaL_argerror(T, 2, "expected table of addresses");
+		lua_pop(T, 1);
+	}
+
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	b = malloc(sizeof(struct lem_ssl_batch));
+	if (b == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "out of memory");
+		return 2;
+	}
+
+	lua_settop(T, 2);
+	lua_createtable(T, n, 0); /* 3: streams */
+	lua_newtable(T);          /* 4: errors */
+	for (i = 1; i <= n; i++) {
+		stream_new(T, NULL, connect_handler, 0);
+		lua_rawseti(T, 3, i);
+	}
+
+	b->T = T;
+	b->c = c;
+	b->n = n;
+	b->next = 1;
+	b->running = 0;
+	b->concurrency = (int)concurrency;
+	cache_init(&b->lookups, 0, lookup_unref);
+
+	if (batch_next(b))
+		return 2;
+
+	return lua_yield(T, 0);
+}
+
+/*
+ * certificates selected by server name
+ */
+static void
+host_free(void *value)
+{
+	struct lem_ssl_host *h = value;
+
+	free(h->certfile);
+	free(h->keyfile);
+	free(h);
+}
+
+static void
+keypair_free(void *value)
+{
+	struct lem_ssl_keypair *kp = value;
+
+	X509_free(kp->cert);
+	sk_X509_pop_free(kp->chain, X509_free);
+	EVP_PKEY_free(kp->key);
+	free(kp);
+}
+
+static struct lem_ssl_keypair *
+keypair_load(const char *certfile, const char *keyfile)
+{
+	struct lem_ssl_keypair *kp;
+	BIO *bio;
+	X509 *x;
+
+	kp = calloc(1, sizeof(struct lem_ssl_keypair));
+	if (kp == NULL)
+		return NULL;
+
+	kp->chain = sk_X509_new_null();
+	if (kp->chain == NULL)
+		goto error;
 
-	case SSL_ERROR_ZERO_RETURN:
-		lem_debug("SSL_ERROR_ZERO_RETURN");
-		msg = "connection closed unexpectedly";
-		break;
-
-	case SSL_ERROR_WANT_READ:
-		lem_debug("SSL_ERROR_WANT_READ");
-		lua_settop(T, 0);
-		s = stream_new(T, ssl, connect_handler, EV_READ);
-		s->T = T;
-		ev_io_start(EV_G_ &s->w);
-		return lua_yield(T, 1);
-
-	case SSL_ERROR_WANT_WRITE:
-		lem_debug("SSL_ERROR_WANT_WRITE");
-	case SSL_ERROR_WANT_CONNECT:
-		lem_debug("SSL_ERROR_WANT_CONNECT");
-		lua_settop(T, 0);
-		s = stream_new(T, ssl, connect_handler, EV_WRITE);
-		s->T = T;
-		ev_io_start(EV_G_ &s->w);
-		return lua_yield(T, 1);
-
-	case SSL_ERROR_SYSCALL:
-		lem_debug("SSL_ERROR_SYSCALL");
-		{
-			long e = ERR_get_error();
-
-			if (e)
-				msg = ERR_reason_error_string(e);
-			else if (ret == 0)
-				msg = "connection closed unexpectedly";
-			else
-				msg = strerror(errno);
+	bio = BIO_new_file(certfile, "r");
+	if (bio == NULL)
+		goto error;
 
+	kp->cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	while ((x = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
+		if (!sk_X509_push(kp->chain, x)) {
+			X509_free(x);
+			BIO_free(bio);
+			goto error;
 		}
-		break;
+	}
+	/* forget about hitting the end of the file */
+	ERR_clear_error();
+	BIO_free(bio);
+	if (kp->cert == NULL)
+		goto error;
+
+	bio = BIO_new_file(keyfile, "r");
+	if (bio == NULL)
+		goto error;
+
+	kp->key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (kp->key == NULL || X509_check_private_key(kp->cert, kp->key) != 1)
+		goto error;
+
+	return kp;
+
+error:
+	keypair_free(kp);
+	return NULL;
+}
+
+static struct lem_ssl_keypair *
+hosts_lookup(struct lem_ssl_hosts *hosts, const char *name)
+{
+	struct lem_ssl_keypair *kp;
+	struct lem_ssl_host *h;
 
-	case SSL_ERROR_SSL:
-		lem_debug("SSL_ERROR_SSL");
-		msg = ERR_reason_error_string(ERR_get_error());
-		break;
+	kp = cache_get(&hosts->loaded, name);
+	if (kp != NULL)
+		return kp;
 
-	default:
-		lem_debug("SSL_ERROR_* (default)");
-		msg = "unexpected error from SSL library";
+	h = cache_get(&hosts->index, name);
+	if (h == NULL)
+		return NULL;
+
+	lem_debug("loading certificate for '%s'", name);
+	kp = keypair_load(h->certfile, h->keyfile);
+	if (kp == NULL)
+		return NULL;
+
+	if (cache_put(&hosts->loaded, name, kp)) {
+		keypair_free(kp);
+		return NULL;
 	}
 
-	lua_pushnil(T);
-	lua_pushfstring(T, "error establishing SSL connection: %s", msg);
-	SSL_free(ssl);
-	return 2;
+	return kp;
 }
 
+static int
+hosts_servername_cb(SSL *ssl, int *ad, void *arg)
+{
+	struct lem_ssl_context *c = context_get(ssl);
+	const char *servername;
+	char name[256];
+	struct lem_ssl_keypair *kp;
+	size_t len;
+	size_t i;
+
+	(void)arg;
+
+	servername = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+	if (servername == NULL || c == NULL || c->hosts == NULL)
+		return SSL_TLSEXT_ERR_NOACK;
 
+	len = strlen(servername);
+	if (len == 0 || len >= sizeof(name))
+		return SSL_TLSEXT_ERR_NOACK;
+
+	for (i = 0; i <= len; i++)
+		name[i] = tolower((unsigned char)servername[i]);
+
+	kp = hosts_lookup(c->hosts, name);
+	if (kp == NULL) {
+		/* try *.domain for sub.domain */
+		char *dot = strchr(name, '.');
+
+		if (dot == NULL || dot == name)
+			return SSL_TLSEXT_ERR_NOACK;
+
+		dot[-1] = '*';
+		kp = hosts_lookup(c->hosts, dot - 1);
+		if (kp == NULL)
+			return SSL_TLSEXT_ERR_NOACK;
+	}
+
+	if (SSL_use_certificate(ssl, kp->cert) != 1 ||
+	    SSL_use_PrivateKey(ssl, kp->key) != 1 ||
+	    SSL_set1_chain(ssl, kp->chain) != 1) {
+		*ad = SSL_AD_INTERNAL_ERROR;
+		return SSL_TLSEXT_ERR_ALERT_FATAL;
+	}
+
+	return SSL_TLSEXT_ERR_OK;
+}
+
+static struct lem_ssl_hosts *
+hosts_get(struct lem_ssl_context *c)
+{
+	struct lem_ssl_hosts *hosts = c->hosts;
+
+	if (hosts != NULL)
+		return hosts;
+
+	hosts = malloc(sizeof(struct lem_ssl_hosts));
+	if (hosts == NULL)
+		return NULL;
+
+	cache_init(&hosts->index, 0, host_free);
+	cache_init(&hosts->loaded, LEM_SSL_HOST_CACHE, keypair_free);
+	c->hosts = hosts;
+	SSL_CTX_set_tlsext_servername_callback(c->ctx, hosts_servername_cb);
+	return hosts;
+}
+
+static int
+context_addhost(lua_State *T)
+{
+	struct lem_ssl_context *c;
+	const char *name;
+	const char *certfile;
+	const char *keyfile;
+	struct lem_ssl_hosts *hosts;
+	struct lem_ssl_host *h;
+	char key[256];
+	size_t len;
+	size_t i;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	name = luaL_checklstring(T, 2, &len);
+	luaL_argcheck(T, len > 0 && len < sizeof(key), 2, "invalid host name");
+	certfile = luaL_checkstring(T, 3);
+	keyfile = luaL_optstring(T, 4, certfile);
+
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	for (i = 0; i <= len; i++)
+		key[i] = tolower((unsigned char)name[i]);
+
+	hosts = hosts_get(c);
+	h = malloc(sizeof(struct lem_ssl_host));
+	if (hosts == NULL || h == NULL)
+		goto nomem;
+
+	h->certfile = strdup(certfile);
+	h->keyfile = strdup(keyfile);
+	if (h->certfile == NULL || h->keyfile == NULL ||
+	    cache_put(&hosts->index, key, h)) {
+		host_free(h);
+		h = NULL;
+		goto nomem;
+	}
+
+	/* forget any certificate loaded for the old files */
+	cache_remove(&hosts->loaded, key);
+
+	lua_pushboolean(T, 1);
+	return 1;
+
+nomem:
+	free(h);
+	lua_pushnil(T);
+	lua_pushliteral(T, "out of memory");
+	return 2;
+}
+
+static int
+context_hostcache(lua_State *T)
+{
+	struct lem_ssl_context *c;
+	lua_Number max;
+	struct lem_ssl_hosts *hosts;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	max = luaL_checknumber(T, 2);
+	luaL_argcheck(T, max >= 1, 2, "invalid size");
+
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	hosts = hosts_get(c);
+	if (hosts == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "out of memory");
+		return 2;
+	}
+
+	hosts->loaded.max = (unsigned int)max;
+	while (hosts->loaded.n > hosts->loaded.max)
+		cache_drop(&hosts->loaded, hosts->loaded.oldest);
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * OCSP stapling
+ *
+ * responses are stored under the SHA1 hash of the
+ * issuer name and the serial number of the certificate
+ */
+#define STAPLE_KEYSIZE (2*SHA_DIGEST_LENGTH + 1 + 2*32 + 1)
+
+static int
+staple_key(char *key, const unsigned char *namehash, int hashlen,
+           const ASN1_INTEGER *serial)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *data = ASN1_STRING_get0_data(serial);
+	int len = ASN1_STRING_length(serial);
+	int i;
+
+	if (hashlen != SHA_DIGEST_LENGTH || len <= 0 || len > 32)
+		return -1;
+
+	for (i = 0; i < hashlen; i++) {
+		*key++ = hex[namehash[i] >> 4];
+		*key++ = hex[namehash[i] & 0xF];
+	}
+	*key++ = ':';
+	for (i = 0; i < len; i++) {
+		*key++ = hex[data[i] >> 4];
+		*key++ = hex[data[i] & 0xF];
+	}
+	*key = '\0';
+	return 0;
+}
+
+static int
+staples_status_cb(SSL *ssl, void *arg)
+{
+	struct lem_ssl_context *c = context_get(ssl);
+	X509 *cert;
+	unsigned char namehash[EVP_MAX_MD_SIZE];
+	unsigned int hashlen;
+	char key[STAPLE_KEYSIZE];
+	struct lem_ssl_staple *st;
+	unsigned char *der;
+
+	(void)arg;
+
+	if (c == NULL || c->staples == NULL)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	/* this is the certificate picked for the
+	 * client, so it also works with context:addhost() */
+	cert = SSL_get_certificate(ssl);
+	if (cert == NULL ||
+	    !X509_NAME_digest(X509_get_issuer_name(cert), EVP_sha1(),
+	                      namehash, &hashlen) ||
+	    staple_key(key, namehash, hashlen, X509_get0_serialNumber(cert)))
+		return SSL_TLSEXT_ERR_NOACK;
+
+	st = cache_get(c->staples, key);
+	if (st == NULL)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	if (st->expires <= ev_now(EV_G)) {
+		lem_debug("dropping expired OCSP response %s", key);
+		cache_remove(c->staples, key);
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+
+	/* OpenSSL frees the response when done with it */
+	der = OPENSSL_malloc(st->len);
+	if (der == NULL)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	memcpy(der, st->der, st->len);
+	SSL_set_tlsext_status_ocsp_resp(ssl, der, st->len);
+	return SSL_TLSEXT_ERR_OK;
+}
+
+/*
+ * store a copy of the response for each certificate it covers
+ */
+static const char *
+staples_add(struct lem_ssl_cache *staples, const unsigned char *der,
+            int len, ev_tstamp *ttl)
+{
+	const unsigned char *p = der;
+	OCSP_RESPONSE *resp;
+	OCSP_BASICRESP *bs = NULL;
+	struct {
+		char key[STAPLE_KEYSIZE];
+		ev_tstamp expires;
+	} *ids = NULL;
+	const char *err = NULL;
+	ev_tstamp now = ev_now(EV_G);
+	int n;
+	int i;
+
+	*ttl = LEM_SSL_STAPLE_TTL;
+
+	resp = d2i_OCSP_RESPONSE(NULL, &p, len);
+	if (resp == NULL)
+		return "invalid OCSP response";
+
+	if (OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+		err = OCSP_response_status_str(OCSP_response_status(resp));
+		goto out;
+	}
+
+	bs = OCSP_response_get1_basic(resp);
+	n = bs ? OCSP_resp_count(bs) : 0;
+	if (n <= 0) {
+		err = "no certificates in OCSP response";
+		goto out;
+	}
+
+	ids = malloc(n * sizeof(ids[0]));
+	if (ids == NULL) {
+		err = "out of memory";
+		goto out;
+	}
+
+	/* check every single response before caching any of them */
+	for (i = 0; i < n; i++) {
+		OCSP_SINGLERESP *single = OCSP_resp_get0(bs, i);
+		ASN1_OCTET_STRING *namehash;
+		ASN1_OBJECT *md;
+		ASN1_INTEGER *serial;
+		ASN1_GENERALIZEDTIME *thisupd;
+		ASN1_GENERALIZEDTIME *nextupd;
+
+		OCSP_single_get0_status(single, NULL, NULL, &thisupd, &nextupd);
+		if (!OCSP_check_validity(thisupd, nextupd, 300, -1)) {
+			err = "OCSP response is not valid now";
+			goto out;
+		}
+
+		OCSP_id_get0_info(&namehash, &md, NULL, &serial,
+		                  (OCSP_CERTID *)OCSP_SINGLERESP_get0_id(single));
+		if (OBJ_obj2nid(md) != NID_sha1 ||
+		    staple_key(ids[i].key, ASN1_STRING_get0_data(namehash),
+		               ASN1_STRING_length(namehash), serial)) {
+			err = "unsupported certificate id in OCSP response";
+			goto out;
+		}
+
+		ids[i].expires = LEM_SSL_STAPLE_TTL;
+		if (nextupd != NULL) {
+			int days;
+			int secs;
+
+			if (!ASN1_TIME_diff(&days, &secs, NULL, nextupd)) {
+				err = "invalid next update time in OCSP response";
+				goto out;
+			}
+			ids[i].expires = 86400.0*days + secs;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		struct lem_ssl_staple *st;
+
+		st = malloc(sizeof(struct lem_ssl_staple) + len);
+		if (st == NULL) {
+			err = "out of memory";
+			goto out;
+		}
+		st->expires = now + ids[i].expires;
+		st->len = len;
+		memcpy(st->der, der, len);
+		if (cache_put(staples, ids[i].key, st)) {
+			free(st);
+			err = "out of memory";
+			goto out;
+		}
+		if (ids[i].expires < *ttl)
+			*ttl = ids[i].expires;
+		lem_debug("stapling OCSP response %s for %gs",
+		          ids[i].key, ids[i].expires);
+	}
+
+out:
+	free(ids);
+	OCSP_BASICRESP_free(bs);
+	OCSP_RESPONSE_free(resp);
+	return err;
+}
+
+static int
+context_staple(lua_State *T)
+{
+	struct lem_ssl_context *c;
+	const char *der;
+	size_t len;
+	const char *err;
+	ev_tstamp ttl = 0;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	der = luaL_checklstring(T, 2, &len);
+	luaL_argcheck(T, len > 0 && len <= INT_MAX, 2, "invalid response");
+
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	if (c->staples == NULL) {
+		c->staples = malloc(sizeof(struct lem_ssl_cache));
+		if (c->staples == NULL) {
+			lua_pushnil(T);
+			lua_pushliteral(T, "out of memory");
+			return 2;
+		}
+		cache_init(c->staples, 0, free);
+		SSL_CTX_set_tlsext_status_cb(c->ctx, staples_status_cb);
+	}
+
+	err = staples_add(c->staples, (const unsigned char *)der,
+	                  (int)len, &ttl);
+	if (err != NULL) {
+		lua_pushnil(T);
+		lua_pushstring(T, err);
+		return 2;
+	}
+
+	lua_pushnumber(T, ttl);
+	return 1;
+}
+
+/*
+ * peer verification
+ *
+ * trust stores are loaded once and shared by all contexts
+ * using the same files, and successful verifications are
+ * remembered under the fingerprint of the peer certificate
+ * and the host name it was checked against
+ */
+static struct lem_ssl_cache verify_stores;
+
+static void
+verify_store_free(void *value)
+{
+	X509_STORE_free(value);
+}
+
+static X509_STORE *
+verify_store(const char *cafile, const char *capath, const char **err)
+{
+	X509_STORE *store;
+	char key[2*PATH_MAX + 2];
+
+	if (snprintf(key, sizeof(key), "%s|%s",
+	             cafile ? cafile : "", capath ? capath : "")
+	    >= (int)sizeof(key)) {
+		*err = "path too long";
+		return NULL;
+	}
+
+	store = cache_get(&verify_stores, key);
+	if (store != NULL)
+		return store;
+
+	store = X509_STORE_new();
+	if (store == NULL) {
+		*err = "out of memory";
+		return NULL;
+	}
+
+	if (cafile == NULL && capath == NULL) {
+		if (!X509_STORE_set_default_paths(store))
+			goto error;
+	} else if (!X509_STORE_load_locations(store, cafile, capath))
+		goto error;
+
+	if (cache_put(&verify_stores, key, store)) {
+		X509_STORE_free(store);
+		*err = "out of memory";
+		return NULL;
+	}
+
+	lem_debug("loaded trust store %s", key);
+	return store;
+
+error:
+	*err = ERR_reason_error_string(ERR_get_error());
+	if (*err == NULL)
+		*err = "unable to load certificates";
+	X509_STORE_free(store);
+	return NULL;
+}
+
+static int
+verify_cb(X509_STORE_CTX *x, void *arg)
+{
+	SSL *ssl = X509_STORE_CTX_get_ex_data(x,
+			SSL_get_ex_data_X509_STORE_CTX_idx());
+	struct lem_ssl_context *c = context_get(ssl);
+	X509 *cert = X509_STORE_CTX_get0_cert(x);
+	const char *host;
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int len;
+	char key[2 + 2*EVP_MAX_MD_SIZE + 1 + 256];
+	char *p = key;
+	ev_tstamp now;
+	ev_tstamp *expires;
+	unsigned int i;
+	int days;
+	int secs;
+	int ret;
+
+	(void)arg;
+
+	if (c == NULL || c->verify == NULL || cert == NULL)
+		return X509_verify_cert(x);
+
+	/* servers remember client certificates on their own, while
+	 * clients only remember certificates checked against the
+	 * host name set with SSL_set1_host(), not an IP address */
+	if (SSL_is_server(ssl)) {
+		*p++ = 's';
+		host = "";
+	} else {
+		*p++ = 'c';
+		host = X509_VERIFY_PARAM_get0_host(SSL_get0_param(ssl), 0);
+		if (host == NULL)
+			return X509_verify_cert(x);
+	}
+	*p++ = ':';
+
+	if (strlen(host) > 255 || !X509_digest(cert, EVP_sha256(), md, &len))
+		return X509_verify_cert(x);
+
+	for (i = 0; i < len; i++) {
+		static const char hex[] = "0123456789abcdef";
+
+		*p++ = hex[md[i] >> 4];
+		*p++ = hex[md[i] & 0xF];
+	}
+	*p++ = ':';
+	strcpy(p, host);
+
+	now = ev_now(EV_G);
+	expires = cache_get(&c->verify->results, key);
+	if (expires != NULL) {
+		if (*expires > now) {
+			lem_debug("certificate already verified");
+			X509_STORE_CTX_set_error(x, X509_V_OK);
+			return 1;
+		}
+		cache_remove(&c->verify->results, key);
+	}
+
+	ret = X509_verify_cert(x);
+	if (ret != 1)
+		return ret;
+
+	expires = malloc(sizeof(ev_tstamp));
+	if (expires == NULL)
+		return ret;
+
+	/* don't remember it past the expiry of the certificate */
+	*expires = now + c->verify->ttl;
+	if (ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(cert)) &&
+	    now + 86400.0*days + secs < *expires)
+		*expires = now + 86400.0*days + secs;
+
+	if (cache_put(&c->verify->results, key, expires))
+		free(expires);
+
+	return ret;
+}
+
+static int
+context_verify(lua_State *T)
+{
+	struct lem_ssl_context *c;
+	const char *cafile;
+	const char *capath;
+	lua_Number ttl;
+	X509_STORE *store;
+	const char *err = NULL;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	cafile = lua_toboolean(T, 2) ? luaL_checkstring(T, 2) : NULL;
+	capath = lua_toboolean(T, 3) ? luaL_checkstring(T, 3) : NULL;
+	ttl = luaL_optnumber(T, 4, LEM_SSL_VERIFY_TTL);
+	luaL_argcheck(T, ttl >= 0, 4, "invalid time to live");
+
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	store = verify_store(cafile, capath, &err);
+	if (store == NULL) {
+		lua_pushnil(T);
+		lua_pushstring(T, err);
+		return 2;
+	}
+
+	/* servers asking for client certificates can't
+	 * resume sessions without a session id context */
+	if (SSL_CTX_set_session_id_context(c->ctx,
+	        (const unsigned char *)LEM_SSL_SESSION_ID_CTX,
+	        sizeof(LEM_SSL_SESSION_ID_CTX) - 1) != 1) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "error setting session id context");
+		return 2;
+	}
+
+	if (c->verify == NULL) {
+		c->verify = malloc(sizeof(struct lem_ssl_verify));
+		if (c->verify == NULL) {
+			lua_pushnil(T);
+			lua_pushliteral(T, "out of memory");
+			return 2;
+		}
+		cache_init(&c->verify->results, LEM_SSL_VERIFY_CACHE, free);
+		SSL_CTX_set_cert_verify_callback(c->ctx, verify_cb, NULL);
+	} else {
+		/* results from the old store no longer count */
+		cache_free(&c->verify->results);
+	}
+	c->verify->ttl = ttl;
+
+	X509_STORE_up_ref(store);
+	SSL_CTX_set_cert_store(c->ctx, store);
+	SSL_CTX_set_verify(c->ctx, SSL_VERIFY_PEER, NULL);
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * event tracing
+ */
+static int
+context_handshakestats(lua_State *T)
+{
+	struct lem_ssl_context *c;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	c->hsstats = lua_isnone(T, 2) || lua_toboolean(T, 2);
+	context_info(c);
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+static int
+context_trace(lua_State *T)
+{
+	struct lem_ssl_context *c;
+	lua_Number size;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	size = luaL_optnumber(T, 2, LEM_SSL_TRACE_SIZE);
+	luaL_argcheck(T, size >= 0 && size <= INT_MAX /
+	                 sizeof(struct lem_ssl_event), 2, "invalid size");
+
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	if (c->trace != NULL)
+		context_untrace(c);
+
+	if (size >= 1)
+		c->trace = trace_new((unsigned int)size);
+	context_info(c);
+
+	if (size >= 1 && c->trace == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "out of memory");
+		return 2;
+	}
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+static int
+context_readtrace(lua_State *T)
+{
+	struct lem_ssl_context *c;
+	struct lem_ssl_trace *t;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	t = c->trace;
+	if (t == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "not tracing");
+		return 2;
+	}
+
+	trace_push(T, t);
+	lua_pushnumber(T, t->lost);
+	t->lost = 0;
+	return 2;
+}
+
+/*
+ * certificate compression, RFC 8879
+ */
+static int
+context_compresscerts(lua_State *T)
+{
+#ifdef LEM_SSL_CERT_COMP
+	static const char *const names[] = {
+		"zlib", "brotli", "zstd", NULL
+	};
+	static const int algs[] = {
+		TLSEXT_comp_cert_zlib,
+		TLSEXT_comp_cert_brotli,
+		TLSEXT_comp_cert_zstd,
+	};
+	struct lem_ssl_context *c;
+	int prefs[3];
+	int n;
+	int i;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	c = lua_touserdata(T, 1);
+	n = lua_gettop(T) - 1;
+	luaL_argcheck(T, n <= 3, 5, "too many algorithms");
+	for (i = 0; i < n; i++)
+		prefs[i] = algs[luaL_checkoption(T, i + 2, NULL, names)];
+
+	if (n == 0) {
+		prefs[0] = TLSEXT_comp_cert_zstd;
+		prefs[1] = TLSEXT_comp_cert_brotli;
+		prefs[2] = TLSEXT_comp_cert_zlib;
+		n = 3;
+	}
+
+	if (c->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	if (!SSL_CTX_set1_cert_comp_preference(c->ctx, prefs, n)) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "compression algorithms not supported");
+		return 2;
+	}
+
+	/* compress our certificate once now instead of in
+	 * every handshake, and report how well it went */
+	lua_newtable(T);
+	if (SSL_CTX_get0_certificate(c->ctx) == NULL ||
+	    !SSL_CTX_compress_certs(c->ctx, 0)) {
+		ERR_clear_error();
+		return 1;
+	}
+
+	for (i = 0; i < 3; i++) {
+		unsigned char *data;
+		size_t orig;
+		size_t len;
+
+		len = SSL_CTX_get1_compressed_cert(c->ctx, algs[i],
+		                                   &data, &orig);
+		if (len == 0)
+			continue;
+
+		OPENSSL_free(data);
+		lua_pushnumber(T, len);
+		lua_setfield(T, -2, names[i]);
+		lua_pushnumber(T, orig);
+		lua_setfield(T, -2, "uncompressed");
+	}
+
+	return 1;
+#else
+	lua_pushnil(T);
+	lua_pushliteral(T, "certificate compression not supported");
+	return 2;
+#endif
+}
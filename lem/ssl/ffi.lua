@@ -0,0 +1,72 @@
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+local ssl = require 'lem.ssl'
+
+local Stream = ssl.Stream
+local read, write = Stream.read, Stream.write
+
+local M = {}
+
+local ok, ffi = pcall(require, 'ffi')
+if not ok then
+	-- plain Lua, just use the methods
+	M.ffi = false
+
+	function M.read(stream)
+		return read(stream)
+	end
+
+	M.write = write
+
+	return M
+end
+
+M.ffi = true
+
+local tryread = ffi.cast('int (*)(void *, char *, int)', ssl.abi.tryread)
+local trywrite = ffi.cast('int (*)(void *, const char *, int)', ssl.abi.trywrite)
+
+local bufsize = 16384
+local buf = ffi.new('char[?]', bufsize)
+
+-- read available data, only suspending
+-- the coroutine if there is none
+function M.read(stream)
+	local n = tryread(stream, buf, bufsize)
+	if n > 0 then
+		return ffi.string(buf, n)
+	end
+
+	return read(stream)
+end
+
+-- write data, only suspending the coroutine
+-- if it can't be written right away
+function M.write(stream, data)
+	local len = #data
+	if trywrite(stream, data, len) == len then
+		return true
+	end
+
+	return write(stream, data)
+end
+
+return M
+
+-- vim: ts=2 sw=2 noet:
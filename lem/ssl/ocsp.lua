@@ -0,0 +1,75 @@
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+local utils = require 'lem.utils'
+
+local M = {}
+
+-- fetcher reading a DER encoded response from a file
+function M.file(path)
+	return function()
+		local f, err = io.open(path, 'rb')
+		if not f then return nil, err end
+
+		local der = f:read('*a')
+		f:close()
+		return der
+	end
+end
+
+-- keep the OCSP responses stapled by context fresh
+-- fetch() is called in a new coroutine and again when
+-- half the validity of the last response has passed,
+-- so handshakes never wait for it
+function M.staple(context, fetch, retry, onerror)
+	local sleeper = utils.sleeper()
+	local running = true
+
+	retry = retry or 60
+
+	utils.spawn(function()
+		while running do
+			local der, err = fetch()
+			local ttl
+			if der then
+				ttl, err = context:staple(der)
+				if err == 'closed' then break end
+			end
+
+			local delay
+			if ttl then
+				delay = math.max(ttl / 2, 1)
+			else
+				if onerror then onerror(err) end
+				delay = retry
+			end
+
+			sleeper:sleep(delay)
+		end
+	end)
+
+	-- return a function to stop refreshing
+	return function()
+		running = false
+		sleeper:wakeup()
+	end
+end
+
+return M
+
+-- vim: ts=2 sw=2 noet:
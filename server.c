@@ -0,0 +1,355 @@
+/*
+ * This file is part of lem-ssl.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-ssl is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-ssl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+static struct lem_ssl_context *context_get(SSL *ssl);
+
+static void
+ctx_ref(SSL_CTX *ctx)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_CTX_up_ref(ctx);
+#else
+	CRYPTO_add(&ctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+#endif
+}
+
+static int
+server_closed(lua_State *T)
+{
+	struct lem_ssl_server *srv;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	srv = lua_touserdata(T, 1);
+	lua_pushboolean(T, srv->ctx == NULL);
+	return 1;
+}
+
+static int
+server_busy(lua_State *T)
+{
+	struct lem_ssl_server *srv;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	srv = lua_touserdata(T, 1);
+	lua_pushboolean(T, srv->T != NULL);
+	return 1;
+}
+
+static void
+server_wakeup(struct lem_ssl_server *srv, const char *msg)
+{
+	ev_io_stop(EV_G_ &srv->w);
+	lua_settop(srv->T, 0);
+	lua_pushnil(srv->T);
+	lua_pushstring(srv->T, msg);
+	lem_queue(srv->T, 2);
+	srv->T = NULL;
+}
+
+static int
+server_close(lua_State *T)
+{
+	struct lem_ssl_server *srv;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	srv = lua_touserdata(T, 1);
+	if (srv->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "already closed");
+		return 2;
+	}
+
+	if (srv->T != NULL) {
+		lem_debug("interrupting accept");
+		server_wakeup(srv, "interrupted");
+	}
+
+	lem_debug("closing server..");
+	close(srv->w.fd);
+	SSL_CTX_free(srv->ctx);
+	srv->ctx = NULL;
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+static int
+server_interrupt(lua_State *T)
+{
+	struct lem_ssl_server *srv;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	srv = lua_touserdata(T, 1);
+	if (srv->T == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "not busy");
+		return 2;
+	}
+
+	lem_debug("interrupting accept");
+	server_wakeup(srv, "interrupted");
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * set up a stream for a newly accepted socket
+ * the handshake happens on the first read or write
+ */
+static int
+server_attach(lua_State *T, struct lem_ssl_server *srv,
+              struct lem_ssl_stream *s, int fd)
+{
+	struct lem_ssl_context *c;
+	SSL *ssl;
+	BIO *bio;
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) ||
+	    fcntl(fd, F_SETFL, O_NONBLOCK)) {
+		lua_pushnil(T);
+		lua_pushfstring(T, "error accepting connection: %s",
+		                strerror(errno));
+		close(fd);
+		return 2;
+	}
+
+	ssl = SSL_new(srv->ctx);
+	if (ssl == NULL) {
+		lua_pushnil(T);
+		lua_pushfstring(T, "error creating SSL connection: %s",
+		                ERR_reason_error_string(ERR_get_error()));
+		close(fd);
+		return 2;
+	}
+
+	c = context_get(ssl);
+	if (c != NULL && c->trace != NULL) {
+		trace_attach(s, ssl, c->trace);
+		stream_trace(s, LEM_SSL_TRACE_ACCEPT, 0);
+	}
+
+	bio = BIO_new_socket(fd, BIO_CLOSE);
+	if (bio == NULL) {
+		lua_pushnil(T);
+		lua_pushfstring(T, "error creating BIO: %s",
+		                ERR_reason_error_string(ERR_get_error()));
+		SSL_free(ssl);
+		close(fd);
+		return 2;
+	}
+
+	stream_set_bio(s, ssl, bio);
+	SSL_set_accept_state(ssl);
+	s->ssl = ssl;
+	ev_io_set(&s->w, fd, 0);
+	ev_io_set(&s->wr.w, fd, 0);
+	return 1;
+}
+
+static void
+server_handler(EV_P_ struct ev_io *w, int revents)
+{
+	struct lem_ssl_server *srv = (struct lem_ssl_server *)w;
+	lua_State *T = srv->T;
+	int fd;
+	int ret;
+
+	(void)revents;
+
+	fd = accept(w->fd, NULL, NULL);
+	if (fd < 0) {
+		switch (errno) {
+		case EAGAIN:
+		case EINTR:
+		case ECONNABORTED:
+			return;
+		}
+
+		server_wakeup(srv, strerror(errno));
+		return;
+	}
+
+	ev_io_stop(EV_G_ &srv->w);
+	srv->T = NULL;
+	ret = server_attach(T, srv, srv->s, fd);
+	lem_queue(T, ret);
+}
+
+static int
+server_accept(lua_State *T)
+{
+	struct lem_ssl_server *srv;
+	struct lem_ssl_stream *s;
+	int fd;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	srv = lua_touserdata(T, 1);
+	if (srv->ctx == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	if (srv->T != NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "busy");
+		return 2;
+	}
+
+	fd = accept(srv->w.fd, NULL, NULL);
+	if (fd < 0 && errno != EAGAIN && errno != EINTR &&
+	    errno != ECONNABORTED) {
+		lua_pushnil(T);
+		lua_pushfstring(T, "error accepting connection: %s",
+		                strerror(errno));
+		return 2;
+	}
+
+	/* the stream is created up front, since
+	 * the Stream metatable is only reachable here */
+	lua_settop(T, 0);
+	s = stream_new(T, NULL, NULL, 0);
+
+	if (fd >= 0)
+		return server_attach(T, srv, s, fd);
+
+	srv->T = T;
+	srv->s = s;
+	ev_io_start(EV_G_ &srv->w);
+	return lua_yield(T, 1);
+}
+
+/*
+ * create a server listening on host and port, sharing
+ * the port with other processes if reuseport is set
+ */
+static int
+server_new(lua_State *T, SSL_CTX *ctx,
+           const char *host, const char *port, int backlog, int reuseport)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	struct lem_ssl_server *srv;
+	int fd = -1;
+	int err = 0;
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+#ifndef SO_REUSEPORT
+	if (reuseport) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "SO_REUSEPORT not supported");
+		return 2;
+	}
+#endif
+
+	if (host[0] == '\0' || (host[0] == '*' && host[1] == '\0'))
+		host = NULL;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret) {
+		lua_pushnil(T);
+		lua_pushfstring(T, "error looking up '%s': %s",
+		                host ? host : "*", gai_strerror(ret));
+		return 2;
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		int on = 1;
+
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			err = errno;
+			continue;
+		}
+
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+#ifdef SO_REUSEPORT
+		    /* let several processes listen on the same port */
+		    (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+		                             &on, sizeof(on))) ||
+#endif
+		    fcntl(fd, F_SETFD, FD_CLOEXEC) ||
+		    fcntl(fd, F_SETFL, O_NONBLOCK) ||
+		    bind(fd, ai->ai_addr, ai->ai_addrlen) ||
+		    listen(fd, backlog)) {
+			err = errno;
+			close(fd);
+			fd = -1;
+			continue;
+		}
+
+		break;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		lua_pushnil(T);
+		lua_pushfstring(T, "error listening: %s", strerror(err));
+		return 2;
+	}
+
+	/* create userdata and set the metatable */
+	srv = lua_newuserdata(T, sizeof(struct lem_ssl_server));
+	lua_pushvalue(T, lua_upvalueindex(1));
+	lua_setmetatable(T, -2);
+
+	/* initialize userdata */
+	ev_io_init(&srv->w, server_handler, fd, EV_READ);
+	srv->T = NULL;
+	srv->ctx = ctx;
+	srv->s = NULL;
+	ctx_ref(ctx);
+
+	return 1;
+}
+
+/*
+ * ssl.fork() function
+ */
+static int
+module_fork(lua_State *T)
+{
+	int n = (int)luaL_checknumber(T, 1);
+	int i;
+
+	for (i = 2; i <= n; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			lua_pushnil(T);
+			lua_pushfstring(T, "error forking: %s", strerror(errno));
+			return 2;
+		}
+
+		if (pid == 0) {
+			ev_loop_fork(EV_G);
+			lua_pushnumber(T, i);
+			return 1;
+		}
+	}
+
+	lua_pushnumber(T, 1);
+	return 1;
+}
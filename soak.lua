@@ -0,0 +1,194 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+--
+-- Soak test: ramp up to many concurrent streams against a local
+-- TLS echo server and keep them busy with mixed traffic.
+--
+-- Usage: soak.lua [address] [streams] [seconds] [step]
+--
+-- The server must echo back everything it receives, eg.
+--
+--   openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost \
+--     -keyout key.pem -out cert.pem
+--   socat OPENSSL-LISTEN:4433,fork,reuseaddr,cert=cert.pem,key=key.pem,verify=0 EXEC:cat
+--
+-- Remember to raise the file descriptor limit (ulimit -n) of both
+-- the server and this script.
+--
+
+local utils = require 'lem.utils'
+local ssl   = require 'lem.ssl'
+
+local address = arg[1] or 'localhost:4433'
+local target  = tonumber(arg[2]) or 10000
+local seconds = tonumber(arg[3]) or 60
+local step    = tonumber(arg[4]) or 1000
+
+local now, spawn = utils.now, utils.spawn
+local format = string.format
+
+local function rss()
+	local f = io.open('/proc/self/status')
+	if not f then return 0 end
+	local kb = f:read('*a'):match('VmRSS:%s*(%d+)')
+	f:close()
+	return tonumber(kb) or 0
+end
+
+local function percentile(sorted, p)
+	if #sorted == 0 then return 0 end
+	return sorted[math.max(1, math.ceil(#sorted * p))]
+end
+
+local stats = {
+	attempts  = 0,
+	failed    = 0,
+	open      = 0,
+	lines     = 0,
+	blobs     = 0,
+	writes    = 0,
+	errors    = {},
+	lag       = {},
+}
+
+local function failure(err)
+	stats.errors[err] = (stats.errors[err] or 0) + 1
+end
+
+local running = true
+
+-- measure how late a 10ms sleep wakes up
+spawn(function()
+	local sleeper = utils.sleeper()
+	local lag = stats.lag
+
+	while running do
+		local t = now()
+		sleeper:sleep(0.01)
+		lag[#lag + 1] = (now() - t - 0.01) * 1000
+	end
+end)
+
+local blob = string.rep('0123456789abcdef', 256)
+
+-- keep a stream busy with a mix of line reads,
+-- fixed size reads and plain writes
+local function traffic(id, conn)
+	local sleeper = utils.sleeper()
+	local seq = 0
+
+	while running do
+		seq = seq + 1
+
+		local ok, err = conn:write(format('%d %d\n', id, seq))
+		if not ok then failure(err) break end
+		local line, err = conn:read('*l')
+		if not line then failure(err) break end
+		stats.lines = stats.lines + 1
+
+		if seq % 4 == 0 then
+			local ok, err = conn:write(blob)
+			if not ok then failure(err) break end
+			local data, err = conn:read(#blob)
+			if not data then failure(err) break end
+			if data ~= blob then failure('corrupted data') break end
+			stats.blobs = stats.blobs + 1
+		end
+
+		-- exercise the interrupt path now and then
+		if seq % 64 == 0 then
+			spawn(function() conn:interrupt() end)
+			local data, err = conn:read('*l')
+			if data or err ~= 'interrupted' then
+				failure('interrupt: ' .. tostring(data or err))
+				break
+			end
+		end
+
+		stats.writes = stats.writes + 1
+		sleeper:sleep(0.05 + math.random() * 0.2)
+	end
+
+	stats.open = stats.open - 1
+	conn:close()
+end
+
+local function report(label)
+	local lag = {}
+	for i, v in ipairs(stats.lag) do lag[i] = v end
+	table.sort(lag)
+	stats.lag = {}
+
+	local mem = rss() - stats.rss
+	print(format('%-8s streams %6d  rss/stream %6.1fkB  ' ..
+	             'lag p50 %6.2fms p99 %7.2fms max %7.2fms  ' ..
+	             'handshake failures %d/%d (%.2f%%)  lines %d blobs %d',
+		label, stats.open,
+		stats.open > 0 and mem / stats.open or 0,
+		percentile(lag, 0.5), percentile(lag, 0.99), lag[#lag] or 0,
+		stats.failed, stats.attempts,
+		stats.attempts > 0 and 100 * stats.failed / stats.attempts or 0,
+		stats.lines, stats.blobs))
+end
+
+local context = assert(ssl.newcontext())
+stats.rss = rss()
+
+spawn(function()
+	local sleeper = utils.sleeper()
+
+	-- ramp up one step at a time
+	while stats.attempts < target do
+		local n = math.min(step, target - stats.attempts)
+		local addresses = {}
+		for i = 1, n do addresses[i] = address end
+
+		local t = now()
+		local streams, errors = context:connectmany(addresses)
+		stats.attempts = stats.attempts + n
+		for i, err in pairs(errors) do
+			stats.failed = stats.failed + 1
+			failure(err)
+		end
+		for i, conn in pairs(streams) do
+			stats.open = stats.open + 1
+			spawn(traffic, stats.attempts - n + i, conn)
+		end
+
+		report(format('%.1fs', now() - t))
+	end
+
+	-- then hold steady
+	local stop = now() + seconds
+	while now() < stop do
+		sleeper:sleep(5)
+		report('steady')
+	end
+
+	running = false
+	sleeper:sleep(1)
+	report('done')
+
+	for err, count in pairs(stats.errors) do
+		print(format('%8d x %s', count, err))
+	end
+end)
+
+-- vim: ts=2 sw=2 noet:
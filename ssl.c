@@ -17,22 +17,50 @@
  */
 
 #include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/pem.h>
+#include <openssl/ocsp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 
 #include "ssl.h"
 
+#include "cache.c"
+#include "trace.c"
 #include "stream.c"
+#include "connect.c"
+#include "server.c"
 #include "context.c"
 
 int
 luaopen_lem_ssl(lua_State *L)
 {
+	int i;
+
 	/* initialize ssl library */
 	SSL_library_init();
 	SSL_load_error_strings();
+	context_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	cache_init(&verify_stores, 0, verify_store_free);
 
 	/* create module table */
 	lua_newtable(L);
@@ -57,15 +85,83 @@ luaopen_lem_ssl(lua_State *L)
 	/* mt.read = <stream_read> */
 	lua_pushcfunction(L, stream_read);
 	lua_setfield(L, -2, "read");
+	/* mt.readframe = <stream_readframe> */
+	lua_pushcfunction(L, stream_readframe);
+	lua_setfield(L, -2, "readframe");
 	/* mt.write = <stream_write> */
 	lua_pushcfunction(L, stream_write);
 	lua_setfield(L, -2, "write");
+	/* mt.buffer = <stream_buffer> */
+	lua_pushcfunction(L, stream_buffer);
+	lua_setfield(L, -2, "buffer");
+	/* mt.drain = <stream_drain> */
+	lua_pushcfunction(L, stream_drain);
+	lua_setfield(L, -2, "drain");
+	/* mt.sendfile = <stream_sendfile> */
+	lua_pushcfunction(L, stream_sendfile);
+	lua_setfield(L, -2, "sendfile");
 	/* mt.interrupt = <stream_interrupt> */
 	lua_pushcfunction(L, stream_interrupt);
 	lua_setfield(L, -2, "interrupt");
+	/* mt.readchunked = <stream_readchunked> */
+	lua_pushcfunction(L, stream_readchunked);
+	lua_setfield(L, -2, "readchunked");
+	/* mt.queue = <stream_queue> */
+	lua_pushcfunction(L, stream_queue);
+	lua_setfield(L, -2, "queue");
+	/* mt.stats = <stream_stats> */
+	lua_pushcfunction(L, stream_stats);
+	lua_setfield(L, -2, "stats");
 	/* insert table */
 	lua_setfield(L, -2, "Stream");
 
+	/* create table of functions for foreign function interfaces */
+	lua_newtable(L);
+	/* abi.tryread = <lem_ssl_tryread> */
+	lua_pushlightuserdata(L, (void *)lem_ssl_tryread);
+	lua_setfield(L, -2, "tryread");
+	/* abi.trywrite = <lem_ssl_trywrite> */
+	lua_pushlightuserdata(L, (void *)lem_ssl_trywrite);
+	lua_setfield(L, -2, "trywrite");
+	/* insert table */
+	lua_setfield(L, -2, "abi");
+
+	/* create array of trace event names */
+	lua_newtable(L);
+	for (i = 0; trace_names[i] != NULL; i++) {
+		lua_pushstring(L, trace_names[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	/* insert table */
+	lua_setfield(L, -2, "events");
+
+	/* create metatable for server objects */
+	lua_newtable(L);
+	/* mt.__index = mt */
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	/* mt.__gc = <server_close> */
+	lua_pushcfunction(L, server_close);
+	lua_setfield(L, -2, "__gc");
+	/* mt.closed = <server_closed> */
+	lua_pushcfunction(L, server_closed);
+	lua_setfield(L, -2, "closed");
+	/* mt.busy = <server_busy> */
+	lua_pushcfunction(L, server_busy);
+	lua_setfield(L, -2, "busy");
+	/* mt.close = <server_close> */
+	lua_pushcfunction(L, server_close);
+	lua_setfield(L, -2, "close");
+	/* mt.interrupt = <server_interrupt> */
+	lua_pushcfunction(L, server_interrupt);
+	lua_setfield(L, -2, "interrupt");
+	/* mt.accept = <server_accept> */
+	lua_getfield(L, -2, "Stream"); /* upvalue 1 = Stream */
+	lua_pushcclosure(L, server_accept, 1);
+	lua_setfield(L, -2, "accept");
+	/* insert table */
+	lua_setfield(L, -2, "Server");
+
 	/* create metatable for context objects */
 	lua_newtable(L);
 	/* mt.__index = mt */
@@ -78,6 +174,50 @@ luaopen_lem_ssl(lua_State *L)
 	lua_getfield(L, -2, "Stream"); /* upvalue 1 = Stream */
 	lua_pushcclosure(L, context_connect, 1);
 	lua_setfield(L, -2, "connect");
+	/* mt.connectmany = <context_connectmany> */
+	lua_getfield(L, -2, "Stream"); /* upvalue 1 = Stream */
+	lua_pushcclosure(L, context_connectmany, 1);
+	lua_setfield(L, -2, "connectmany");
+	/* mt.listen = <context_listen> */
+	lua_getfield(L, -2, "Server"); /* upvalue 1 = Server */
+	lua_pushcclosure(L, context_listen, 1);
+	lua_setfield(L, -2, "listen");
+	/* mt.usecertificate = <context_usecertificate> */
+	lua_pushcfunction(L, context_usecertificate);
+	lua_setfield(L, -2, "usecertificate");
+	/* mt.readahead = <context_readahead> */
+	lua_pushcfunction(L, context_readahead);
+	lua_setfield(L, -2, "readahead");
+	/* mt.ktls = <context_ktls> */
+	lua_pushcfunction(L, context_ktls);
+	lua_setfield(L, -2, "ktls");
+	/* mt.addhost = <context_addhost> */
+	lua_pushcfunction(L, context_addhost);
+	lua_setfield(L, -2, "addhost");
+	/* mt.hostcache = <context_hostcache> */
+	lua_pushcfunction(L, context_hostcache);
+	lua_setfield(L, -2, "hostcache");
+	/* mt.verify = <context_verify> */
+	lua_pushcfunction(L, context_verify);
+	lua_setfield(L, -2, "verify");
+	/* mt.compresscerts = <context_compresscerts> */
+	lua_pushcfunction(L, context_compresscerts);
+	lua_setfield(L, -2, "compresscerts");
+	/* mt.handshakestats = <context_handshakestats> */
+	lua_pushcfunction(L, context_handshakestats);
+	lua_setfield(L, -2, "handshakestats");
+	/* mt.trace = <context_trace> */
+	lua_pushcfunction(L, context_trace);
+	lua_setfield(L, -2, "trace");
+	/* mt.readtrace = <context_readtrace> */
+	lua_pushcfunction(L, context_readtrace);
+	lua_setfield(L, -2, "readtrace");
+	/* mt.staple = <context_staple> */
+	lua_pushcfunction(L, context_staple);
+	lua_setfield(L, -2, "staple");
+	/* mt.ticketkeys = <context_ticketkeys> */
+	lua_pushcfunction(L, context_ticketkeys);
+	lua_setfield(L, -2, "ticketkeys");
 	/* insert table */
 	lua_setfield(L, -2, "Context");
 
@@ -86,5 +226,9 @@ luaopen_lem_ssl(lua_State *L)
 	lua_pushcclosure(L, context_new, 1);
 	lua_setfield(L, -2, "newcontext");
 
+	/* insert fork function */
+	lua_pushcfunction(L, module_fork);
+	lua_setfield(L, -2, "fork");
+
 	return 1;
 }
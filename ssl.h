@@ -22,30 +22,282 @@
 #include <lem.h>
 
 #define LEM_SSL_STREAM_BUFSIZE 1024
+#define LEM_SSL_SENDFILE_BLOCKSIZE 65536
+#define LEM_SSL_FRAME_MAX          0x1000000
+#define LEM_SSL_CHUNKED_MAX        65536
+#define LEM_SSL_OUTPUT_HIGH        65536
+#define LEM_SSL_CONNECT_DELAY      0.25
+#define LEM_SSL_CONNECT_TIMEOUT    10.0
+#define LEM_SSL_LISTEN_BACKLOG     1024
+#define LEM_SSL_TICKET_KEYSIZE     80
+#define LEM_SSL_TICKET_KEYS        8
+#define LEM_SSL_HOST_CACHE         1024
+#define LEM_SSL_STAPLE_TTL         3600.0
+#define LEM_SSL_VERIFY_CACHE       1024
+#define LEM_SSL_VERIFY_TTL         300.0
+#define LEM_SSL_SESSION_ID_CTX     "lem-ssl"
+#define LEM_SSL_READ_AHEAD         65536
+#define LEM_SSL_TRACE_SIZE         4096
+
+/* events recorded by context:trace() */
+#define LEM_SSL_TRACE_CONNECT      1
+#define LEM_SSL_TRACE_RESOLVED     2
+#define LEM_SSL_TRACE_TCP          3
+#define LEM_SSL_TRACE_ACCEPT       4
+#define LEM_SSL_TRACE_HANDSHAKE    5
+#define LEM_SSL_TRACE_HANDSHAKEN   6
+#define LEM_SSL_TRACE_STATE        7
+#define LEM_SSL_TRACE_ALERT        8
+#define LEM_SSL_TRACE_WANT_READ    9
+#define LEM_SSL_TRACE_WANT_WRITE   10
+#define LEM_SSL_TRACE_READ         11
+#define LEM_SSL_TRACE_WRITE        12
+#define LEM_SSL_TRACE_INTERRUPT    13
+#define LEM_SSL_TRACE_CLOSE        14
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+#define LEM_SSL_KTLS
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L && !defined(OPENSSL_NO_COMP_ALG)
+#define LEM_SSL_CERT_COMP
+#endif
+
+struct lem_ssl_entry {
+	struct lem_ssl_entry *next;
+	struct lem_ssl_entry *newer;
+	struct lem_ssl_entry *older;
+	void *value;
+	char key[];
+};
+
+struct lem_ssl_cache {
+	struct lem_ssl_entry **buckets;
+	unsigned int nbuckets;
+	unsigned int n;
+	unsigned int max;
+	void (*free)(void *value);
+	struct lem_ssl_entry *newest;
+	struct lem_ssl_entry *oldest;
+};
+
+struct lem_ssl_host {
+	char *certfile;
+	char *keyfile;
+};
+
+struct lem_ssl_keypair {
+	X509 *cert;
+	STACK_OF(X509) *chain;
+	EVP_PKEY *key;
+};
+
+struct lem_ssl_hosts {
+	struct lem_ssl_cache index;
+	struct lem_ssl_cache loaded;
+};
+
+struct lem_ssl_staple {
+	ev_tstamp expires;
+	int len;
+	unsigned char der[];
+};
+
+struct lem_ssl_verify {
+	struct lem_ssl_cache results;
+	ev_tstamp ttl;
+};
+
+struct lem_ssl_tickets {
+	struct ev_timer w;
+	char *path;
+	int n;
+	unsigned char keys[LEM_SSL_TICKET_KEYS][LEM_SSL_TICKET_KEYSIZE];
+};
+
+struct lem_ssl_event {
+	double time;
+	unsigned int stream;
+	unsigned short event;
+	unsigned short arg;
+};
+
+struct lem_ssl_trace {
+	int refs;
+	int enabled;
+	unsigned int ids;
+	unsigned int size;
+	unsigned int start;
+	unsigned int n;
+	unsigned long lost;
+	struct lem_ssl_event ev[];
+};
 
 struct lem_ssl_context {
 	SSL_CTX *ctx;
+	struct lem_ssl_tickets *tickets;
+	struct lem_ssl_hosts *hosts;
+	struct lem_ssl_cache *staples;
+	struct lem_ssl_verify *verify;
+	struct lem_ssl_trace *trace;
+	int hsstats;
+};
+
+struct lem_ssl_server {
+	struct ev_io w;
+	lua_State *T;
+	SSL_CTX *ctx;
+	struct lem_ssl_stream *s;
+};
+
+struct lem_ssl_stream;
+struct lem_ssl_batch;
+
+struct lem_ssl_output {
+	struct ev_io w;
+	struct lem_ssl_stream *s;
+	lua_State *T;
+	char *buf;
+	size_t size;
+	size_t start;
+	size_t end;
+	size_t low;
+	size_t high;
+	size_t wait;
+};
+
+struct lem_ssl_stats {
+	unsigned long recv;
+	unsigned long send;
+	unsigned long long received;
+	unsigned long long sent;
+	unsigned long long hsreceived;
+	unsigned long long hssent;
+};
+
+struct lem_ssl_stream;
+
+struct lem_ssl_pending {
+	struct lem_ssl_pending *next;
+	lua_State *T;
+	int (*start)(lua_State *T, struct lem_ssl_stream *s);
+};
+
+/* the write slot, so writes don't wait for reads */
+struct lem_ssl_writer {
+	struct ev_io w;
+	struct lem_ssl_stream *s;
+	lua_State *T;
+	struct lem_ssl_pending *first;
+	struct lem_ssl_pending **last;
 };
 
 struct lem_ssl_stream {
 	struct ev_io w;
 	lua_State *T;
 	SSL *ssl;
+	struct lem_ssl_writer wr;
+	struct lem_ssl_output *out;
+	struct lem_ssl_stats stats;
+	struct lem_ssl_trace *trace;
+	unsigned int id;
+	int queue;
+	struct lem_ssl_pending *first;
+	struct lem_ssl_pending **last;
 	char *readp;
 	char *writep;
 
+	/* state of stream:readchunked() kept between calls */
+	struct {
+		int state;
+		unsigned long left;
+	} chunked;
+
 	union {
 		struct {
 			int parts;
 			int target;
+			int header;
+			int little;
+			int max;
 		} in;
+		struct {
+			struct lem_ssl_batch *batch;
+			int index;
+		} connect;
+	};
+
+	union {
 		struct {
 			const char *buf;
 			size_t len;
 		} write;
+		struct {
+			const char *buf;
+			size_t len;
+			char *block;
+			int fd;
+			int close;
+			off_t offset;
+			off_t remaining;
+		} sendfile;
 	};
 
 	char buf[LEM_SSL_STREAM_BUFSIZE];
 };
 
+/* the addresses of a host, shared by the connections of a batch */
+struct lem_ssl_lookup {
+	int refs;
+	int err;
+	struct addrinfo *res;
+};
+
+struct lem_ssl_connector;
+
+struct lem_ssl_attempt {
+	struct ev_io w;
+	struct ev_timer timeout;
+	struct lem_ssl_connector *c;
+	struct addrinfo *ai;
+};
+
+struct lem_ssl_connector {
+	struct ev_timer delay;
+	struct lem_ssl_stream *s;
+	SSL *ssl;
+	struct lem_ssl_lookup *lookup;
+	int n;
+	int started;
+	int running;
+	int err;
+	struct lem_ssl_attempt a[];
+};
+
+struct lem_ssl_batch {
+	lua_State *T;
+	struct lem_ssl_context *c;
+	int n;
+	int next;
+	int running;
+	int concurrency;
+	struct lem_ssl_cache lookups;
+};
+
+/*
+ * non-yielding read and write for foreign function interfaces
+ *
+ * both return the number of bytes transferred or one of
+ * the negative status codes below, in which case the
+ * yielding methods should be used to finish the job
+ */
+#define LEM_SSL_WANT_READ  -1
+#define LEM_SSL_WANT_WRITE -2
+#define LEM_SSL_CLOSED     -3
+#define LEM_SSL_BUSY       -4
+#define LEM_SSL_ERROR      -5
+
+int lem_ssl_tryread(struct lem_ssl_stream *s, char *buf, int len);
+int lem_ssl_trywrite(struct lem_ssl_stream *s, const char *buf, int len);
+
 #endif
@@ -16,33 +16,189 @@
  * along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+static void sendfile_handler(EV_P_ struct ev_io *w, int revents);
+static void write_handler(EV_P_ struct ev_io *w, int revents);
+static void sendfile_close(struct lem_ssl_stream *s);
+static void output_kick(struct lem_ssl_stream *s);
+
 static inline void
-stream_io_register(struct lem_ssl_stream *s, int events)
+io_register(struct ev_io *w, int events)
+{
+	if (w->events == events)
+		return;
+
+	if (w->events)
+		ev_io_stop(EV_G_ w);
+
+	w->events = events;
+	ev_io_start(EV_G_ w);
+}
+
+static inline void
+io_unregister(struct ev_io *w)
 {
-	if (s->w.events == events)
+	if (w->events == 0)
 		return;
 
-	if (s->w.events)
-		ev_io_stop(EV_G_ &s->w);
+	ev_io_stop(EV_G_ w);
+	w->events = 0;
+}
 
-	s->w.events = events;
-	ev_io_start(EV_G_ &s->w);
+static inline void
+stream_io_register(struct lem_ssl_stream *s, int events)
+{
+	io_register(&s->w, events);
 }
 
 static inline void
 stream_io_unregister(struct lem_ssl_stream *s)
 {
-	if (s->w.events == 0)
+	io_unregister(&s->w);
+}
+
+static inline void
+writer_register(struct lem_ssl_stream *s, int events)
+{
+	io_register(&s->wr.w, events);
+}
+
+static inline void
+writer_unregister(struct lem_ssl_stream *s)
+{
+	io_unregister(&s->wr.w);
+}
+
+static inline void
+output_register(struct lem_ssl_output *out, int events)
+{
+	io_register(&out->w, events);
+}
+
+static inline void
+output_unregister(struct lem_ssl_output *out)
+{
+	io_unregister(&out->w);
+}
+
+static void
+output_wake(struct lem_ssl_output *out, const char *fmt, const char *msg)
+{
+	lua_State *T = out->T;
+
+	if (T == NULL)
+		return;
+
+	out->T = NULL;
+	lua_settop(T, 0);
+	if (fmt == NULL) {
+		lua_pushboolean(T, 1);
+		lem_queue(T, 1);
+		return;
+	}
+
+	lua_pushnil(T);
+	lua_pushfstring(T, fmt, msg);
+	lem_queue(T, 2);
+}
+
+static void
+output_free(struct lem_ssl_stream *s, const char *fmt, const char *msg)
+{
+	struct lem_ssl_output *out = s->out;
+
+	output_unregister(out);
+	output_wake(out, fmt, msg);
+	free(out->buf);
+	free(out);
+	s->out = NULL;
+}
+
+/*
+ * wake up the coroutine in the read or write slot with an error
+ */
+static void
+stream_wake(struct lem_ssl_stream *s, const char *fmt, const char *msg)
+{
+	lua_State *T = s->T;
+
+	if (T == NULL)
+		return;
+
+	stream_io_unregister(s);
+	s->T = NULL;
+	lua_settop(T, 0);
+	lua_pushnil(T);
+	lua_pushfstring(T, fmt, msg);
+	lem_queue(T, 2);
+}
+
+static void
+writer_wake(struct lem_ssl_stream *s, const char *fmt, const char *msg)
+{
+	lua_State *T = s->wr.T;
+
+	if (T == NULL)
 		return;
 
-	ev_io_stop(EV_G_ &s->w);
-	s->w.events = 0;
+	writer_unregister(s);
+	if (s->wr.w.cb == sendfile_handler)
+		sendfile_close(s);
+	s->wr.T = NULL;
+	lua_settop(T, 0);
+	lua_pushnil(T);
+	lua_pushfstring(T, fmt, msg);
+	lem_queue(T, 2);
+}
+
+/*
+ * wake up all coroutines waiting for their turn
+ */
+static void
+pending_wake_queue(struct lem_ssl_pending *p, const char *msg)
+{
+	while (p != NULL) {
+		lua_State *T = p->T;
+
+		p = p->next;
+		lua_settop(T, 0);
+		lua_pushnil(T);
+		lua_pushstring(T, msg);
+		lem_queue(T, 2);
+	}
+}
+
+static void
+pending_wake(struct lem_ssl_stream *s, const char *msg)
+{
+	pending_wake_queue(s->first, msg);
+	s->first = NULL;
+	s->last = &s->first;
+
+	pending_wake_queue(s->wr.first, msg);
+	s->wr.first = NULL;
+	s->wr.last = &s->wr.first;
+}
+
+static void
+stream_ssl_free(struct lem_ssl_stream *s)
+{
+	if (s->out != NULL)
+		output_free(s, "closed", NULL);
+
+	pending_wake(s, "closed");
+	stream_trace(s, LEM_SSL_TRACE_CLOSE, 0);
+
+	SSL_free(s->ssl);
+	s->ssl = NULL;
 }
 
+/*
+ * check the result of an SSL call made by the read slot when w is
+ * the watcher of the stream or else by the write slot
+ */
 static int
-stream_check_error(lua_State *T,
-                    struct lem_ssl_stream *s, int ret,
-                    const char *fmt)
+check_error(lua_State *T, struct lem_ssl_stream *s, struct ev_io *w,
+            int ret, const char *fmt)
 {
 	const char *msg;
 
@@ -59,14 +215,16 @@ stream_check_error(lua_State *T,
 
 	case SSL_ERROR_WANT_READ:
 		lem_debug("SSL_ERROR_WANT_READ");
-		stream_io_register(s, EV_READ);
+		stream_trace(s, LEM_SSL_TRACE_WANT_READ, 0);
+		io_register(w, EV_READ);
 		return 0;
 
 	case SSL_ERROR_WANT_WRITE:
 		lem_debug("SSL_ERROR_WANT_WRITE");
 	case SSL_ERROR_WANT_CONNECT:
 		lem_debug("SSL_ERROR_WANT_CONNECT");
-		stream_io_register(s, EV_WRITE);
+		stream_trace(s, LEM_SSL_TRACE_WANT_WRITE, 0);
+		io_register(w, EV_WRITE);
 		return 0;
 
 	case SSL_ERROR_SYSCALL:
@@ -88,6 +246,8 @@ stream_check_error(lua_State *T,
 	case SSL_ERROR_SSL:
 		lem_debug("SSL_ERROR_SSL");
 		msg = ERR_reason_error_string(ERR_get_error());
+		if (msg == NULL)
+			msg = "unexpected error from SSL library";
 		break;
 
 	default:
@@ -100,12 +260,33 @@ stream_check_error(lua_State *T,
 	lua_pushfstring(T, fmt, msg);
 
 error:
-	stream_io_unregister(s);
-	SSL_free(s->ssl);
-	s->ssl = NULL;
+	ERR_clear_error();
+	io_unregister(w);
+
+	/* the connection is broken, so the other slot fails too */
+	if (w == &s->w)
+		writer_wake(s, "%s", lua_tostring(T, -1));
+	else
+		stream_wake(s, "%s", lua_tostring(T, -1));
+
+	stream_ssl_free(s);
 	return 2;
 }
 
+static inline int
+stream_check_error(lua_State *T, struct lem_ssl_stream *s, int ret,
+                   const char *fmt)
+{
+	return check_error(T, s, &s->w, ret, fmt);
+}
+
+static inline int
+writer_check_error(lua_State *T, struct lem_ssl_stream *s, int ret,
+                   const char *fmt)
+{
+	return check_error(T, s, &s->wr.w, ret, fmt);
+}
+
 
 static struct lem_ssl_stream *
 stream_new(lua_State *T, SSL *ssl,
@@ -119,14 +300,222 @@ stream_new(lua_State *T, SSL *ssl,
 	lua_setmetatable(T, -2);
 
 	/* initialize userdata */
-	ev_io_init(&s->w, cb, SSL_get_fd(ssl), events);
+	ev_io_init(&s->w, cb, ssl == NULL ? -1 : SSL_get_fd(ssl), events);
 	s->T = NULL;
 	s->ssl = ssl;
+	ev_io_init(&s->wr.w, write_handler,
+	           ssl == NULL ? -1 : SSL_get_fd(ssl), 0);
+	s->wr.s = s;
+	s->wr.T = NULL;
+	s->wr.first = NULL;
+	s->wr.last = &s->wr.first;
+	s->out = NULL;
+	memset(&s->stats, 0, sizeof(struct lem_ssl_stats));
+	s->trace = NULL;
+	s->id = 0;
+	s->chunked.state = 0;
+	s->chunked.left = 0;
+	s->queue = 0;
+	s->first = NULL;
+	s->last = &s->first;
 	s->readp = s->writep = s->buf;
 
 	return s;
 }
 
+/*
+ * wait in the queue of a slot for our turn, or
+ * return "busy" if the stream doesn't queue
+ */
+static int
+pending_add(lua_State *T, struct lem_ssl_stream *s,
+            struct lem_ssl_pending ***last,
+            int (*start)(lua_State *T, struct lem_ssl_stream *s))
+{
+	struct lem_ssl_pending *p;
+
+	if (!s->queue) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "busy");
+		return 2;
+	}
+
+	lem_debug("busy, waiting for our turn..");
+	p = lua_newuserdata(T, sizeof(struct lem_ssl_pending));
+	p->next = NULL;
+	p->T = T;
+	p->start = start;
+	**last = p;
+	*last = &p->next;
+	return lua_yield(T, lua_gettop(T));
+}
+
+/*
+ * start the operation of a coroutine
+ *
+ * the start functions never suspend the coroutine, but return 0
+ * when the operation is under way with s->T and the handler set.
+ * arguments are checked before this, so when the stream is busy
+ * the coroutine can wait for its turn with them on its stack.
+ * reads and writes each have their own slot and queue, so
+ * a read waiting for data never holds back writes
+ */
+static int
+stream_start(lua_State *T, struct lem_ssl_stream *s,
+             int (*start)(lua_State *T, struct lem_ssl_stream *s))
+{
+	int ret;
+
+	if (s->T != NULL)
+		return pending_add(T, s, &s->last, start);
+
+	ret = start(T, s);
+	if (ret > 0)
+		return ret;
+
+	return lua_yield(T, lua_gettop(T));
+}
+
+/*
+ * as stream_start() but for writes, which set s->wr.T
+ */
+static int
+writer_start(lua_State *T, struct lem_ssl_stream *s,
+             int (*start)(lua_State *T, struct lem_ssl_stream *s))
+{
+	int ret;
+
+	if (s->wr.T != NULL)
+		return pending_add(T, s, &s->wr.last, start);
+
+	ret = start(T, s);
+	if (ret > 0)
+		return ret;
+
+	return lua_yield(T, lua_gettop(T));
+}
+
+/*
+ * return the results of the current read
+ * and start the next one waiting
+ */
+static void
+stream_done(struct lem_ssl_stream *s, int ret)
+{
+	/* every method reports failure as nil, message */
+	stream_trace(s, LEM_SSL_TRACE_READ, lua_isnil(s->T, -ret));
+	lem_queue(s->T, ret);
+	s->T = NULL;
+
+	while (s->T == NULL && s->first != NULL) {
+		struct lem_ssl_pending *p = s->first;
+		lua_State *T = p->T;
+		int (*start)(lua_State *T, struct lem_ssl_stream *s) = p->start;
+
+		s->first = p->next;
+		if (s->first == NULL)
+			s->last = &s->first;
+
+		/* pop the pending userdata to get
+		 * back the original arguments */
+		lua_pop(T, 1);
+		ret = start(T, s);
+		if (ret > 0)
+			lem_queue(T, ret);
+	}
+}
+
+static void
+writer_done(struct lem_ssl_stream *s, int ret)
+{
+	stream_trace(s, LEM_SSL_TRACE_WRITE, lua_isnil(s->wr.T, -ret));
+	lem_queue(s->wr.T, ret);
+	s->wr.T = NULL;
+
+	while (s->wr.T == NULL && s->wr.first != NULL) {
+		struct lem_ssl_pending *p = s->wr.first;
+		lua_State *T = p->T;
+		int (*start)(lua_State *T, struct lem_ssl_stream *s) = p->start;
+
+		s->wr.first = p->next;
+		if (s->wr.first == NULL)
+			s->wr.last = &s->wr.first;
+
+		lua_pop(T, 1);
+		ret = start(T, s);
+		if (ret > 0)
+			lem_queue(T, ret);
+	}
+}
+
+/*
+ * count the reads and writes on the socket
+ */
+static long
+stream_bio_cb(BIO *bio, int oper, const char *argp, size_t len,
+              int argi, long argl, int ret, size_t *processed)
+{
+	struct lem_ssl_stream *s =
+		(struct lem_ssl_stream *)BIO_get_callback_arg(bio);
+
+	(void)argp;
+	(void)len;
+	(void)argi;
+	(void)argl;
+
+	switch (oper) {
+	case BIO_CB_READ | BIO_CB_RETURN:
+		s->stats.recv++;
+		if (ret > 0)
+			s->stats.received += *processed;
+		break;
+
+	case BIO_CB_WRITE | BIO_CB_RETURN:
+		s->stats.send++;
+		if (ret > 0)
+			s->stats.sent += *processed;
+		break;
+	}
+
+	return ret;
+}
+
+static void
+stream_set_bio(struct lem_ssl_stream *s, SSL *ssl, BIO *bio)
+{
+	BIO_set_callback_ex(bio, stream_bio_cb);
+	BIO_set_callback_arg(bio, (char *)s);
+	SSL_set_bio(ssl, bio, bio);
+	SSL_set_app_data(ssl, s);
+}
+
+/*
+ * note the size of the handshake, and trace its progress
+ */
+static void
+stream_info_cb(const SSL *ssl, int where, int ret)
+{
+	struct lem_ssl_stream *s = SSL_get_app_data(ssl);
+
+	if (s == NULL)
+		return;
+
+	if (where & SSL_CB_HANDSHAKE_START)
+		stream_trace(s, LEM_SSL_TRACE_HANDSHAKE, 0);
+	else if (where & SSL_CB_HANDSHAKE_DONE) {
+		if (s->stats.hsreceived == 0 && s->stats.hssent == 0) {
+			s->stats.hsreceived = s->stats.received;
+			s->stats.hssent = s->stats.sent;
+		}
+		stream_trace(s, LEM_SSL_TRACE_HANDSHAKEN, 0);
+	} else if (s->trace == NULL)
+		return;
+	else if (where & SSL_CB_ALERT)
+		stream_trace(s, LEM_SSL_TRACE_ALERT, ret);
+	else if (where & SSL_CB_LOOP)
+		stream_trace(s, LEM_SSL_TRACE_STATE, SSL_get_state(ssl));
+}
+
 static int
 stream_closed(lua_State *T)
 {
@@ -145,7 +534,8 @@ stream_busy(lua_State *T)
 
 	luaL_checktype(T, 1, LUA_TUSERDATA);
 	s = lua_touserdata(T, 1);
-	lua_pushboolean(T, s->T != NULL);
+	lua_pushboolean(T, s->T != NULL || s->wr.T != NULL ||
+	                   (s->out != NULL && s->out->T != NULL));
 	return 1;
 }
 
@@ -155,11 +545,13 @@ stream_gc(lua_State *T)
 	struct lem_ssl_stream *s = lua_touserdata(T, 1);
 
 	lem_debug("collecting");
-	if (s->ssl == NULL)
-		return 0;;
+	if (s->ssl != NULL)
+		stream_ssl_free(s);
 
-	SSL_free(s->ssl);
-	s->ssl = NULL;
+	if (s->trace != NULL) {
+		trace_unref(s->trace);
+		s->trace = NULL;
+	}
 
 	return 0;
 }
@@ -177,20 +569,19 @@ stream_close(lua_State *T)
 		return 2;
 	}
 
-	if (s->T != NULL) {
+	if (s->T != NULL || s->wr.T != NULL) {
 		lem_debug("interrupting io action");
-		stream_io_unregister(s);
-		lua_settop(s->T, 0);
-		lua_pushnil(s->T);
-		lua_pushliteral(s->T, "interrupted");
-		lem_queue(s->T, 2);
-		s->T = NULL;
+		stream_trace(s, LEM_SSL_TRACE_INTERRUPT, 0);
+		stream_wake(s, "interrupted", NULL);
+		writer_wake(s, "interrupted", NULL);
 	}
 
+	if (s->out != NULL)
+		output_wake(s->out, "interrupted", NULL);
+
 	lem_debug("closing connection..");
 
-	SSL_free(s->ssl);
-	s->ssl = NULL;
+	stream_ssl_free(s);
 
 	lua_pushboolean(T, 1);
 	return 1;
@@ -203,19 +594,25 @@ stream_interrupt(lua_State *T)
 
 	luaL_checktype(T, 1, LUA_TUSERDATA);
 	s = lua_touserdata(T, 1);
-	if (s->T == NULL) {
+	if (s->T == NULL && s->first == NULL &&
+	    s->wr.T == NULL && s->wr.first == NULL &&
+	    (s->out == NULL || s->out->T == NULL)) {
 		lua_pushnil(T);
 		lua_pushliteral(T, "not busy");
 		return 2;
 	}
 
-	lem_debug("interrupting io action");
-	stream_io_unregister(s);
-	lua_settop(s->T, 0);
-	lua_pushnil(s->T);
-	lua_pushliteral(s->T, "interrupted");
-	lem_queue(s->T, 2);
-	s->T = NULL;
+	if (s->T != NULL || s->wr.T != NULL) {
+		lem_debug("interrupting io action");
+		stream_trace(s, LEM_SSL_TRACE_INTERRUPT, 0);
+		stream_wake(s, "interrupted", NULL);
+		writer_wake(s, "interrupted", NULL);
+	}
+
+	if (s->out != NULL)
+		output_wake(s->out, "interrupted", NULL);
+
+	pending_wake(s, "interrupted");
 
 	lua_pushboolean(T, 1);
 	return 1;
@@ -227,6 +624,7 @@ stream_interrupt(lua_State *T)
 static int
 try_read_available(lua_State *T, struct lem_ssl_stream *s)
 {
+	luaL_Buffer b;
 	int count;
 	int ret;
 
@@ -238,7 +636,42 @@ try_read_available(lua_State *T, struct lem_ssl_stream *s)
 		return ret;
 
 	stream_io_unregister(s);
-	lua_pushlstring(T, s->buf, (size_t)count);
+
+	/* with read-ahead several records may have arrived
+	 * at once, so hand over everything already buffered */
+	if (!SSL_has_pending(s->ssl)) {
+		lua_pushlstring(T, s->buf, (size_t)count);
+		return 1;
+	}
+
+	luaL_buffinit(T, &b);
+	luaL_addlstring(&b, s->buf, (size_t)count);
+	do {
+		count = SSL_read(s->ssl, luaL_prepbuffer(&b), LUAL_BUFFERSIZE);
+		if (count <= 0)
+			break;
+
+		lem_debug("read %d more bytes", count);
+		luaL_addsize(&b, count);
+	} while (SSL_has_pending(s->ssl));
+	luaL_pushresult(&b);
+
+	if (count <= 0) {
+		switch (SSL_get_error(s->ssl, count)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+		case SSL_ERROR_ZERO_RETURN:
+			/* the next read will see this again */
+			break;
+
+		default:
+			/* the stream is broken, so report the error
+			 * like any other read would */
+			lua_pop(T, 1);
+			return stream_check_error(T, s, count,
+			                          "error reading from SSL stream: %s");
+		}
+	}
 	return 1;
 }
 
@@ -254,8 +687,7 @@ read_available_handler(EV_P_ struct ev_io *w, int revents)
 	if (ret == 0)
 		return;
 
-	lem_queue(s->T, ret);
-	s->T = NULL;
+	stream_done(s, ret);
 }
 
 static int
@@ -265,7 +697,7 @@ stream_read_available(lua_State *T, struct lem_ssl_stream *s)
 	int ret;
 
 	if (size > 0) {
-		lua_pushfstring(T, s->readp, size);
+		lua_pushlstring(T, s->readp, size);
 		s->readp = s->writep = s->buf;
 		return 1;
 	}
@@ -276,7 +708,7 @@ stream_read_available(lua_State *T, struct lem_ssl_stream *s)
 
 	s->T = T;
 	s->w.cb = read_available_handler;
-	return lua_yield(T, 0);
+	return 0;
 }
 
 /*
@@ -316,6 +748,7 @@ try_read_all(lua_State *T, struct lem_ssl_stream *s)
 
 		case SSL_ERROR_WANT_READ:
 			lem_debug("SSL_ERROR_WANT_READ");
+			stream_trace(s, LEM_SSL_TRACE_WANT_READ, 0);
 			stream_io_register(s, EV_READ);
 			return 0;
 
@@ -323,6 +756,7 @@ try_read_all(lua_State *T, struct lem_ssl_stream *s)
 			lem_debug("SSL_ERROR_WANT_WRITE");
 		case SSL_ERROR_WANT_CONNECT:
 			lem_debug("SSL_ERROR_WANT_CONNECT");
+			stream_trace(s, LEM_SSL_TRACE_WANT_WRITE, 0);
 			stream_io_register(s, EV_WRITE);
 			return 0;
 
@@ -358,8 +792,7 @@ out:
 	lua_concat(T, s->in.parts);
 
 	stream_io_unregister(s);
-	SSL_free(s->ssl);
-	s->ssl = NULL;
+	stream_ssl_free(s);
 	return 1;
 
 error:
@@ -367,8 +800,7 @@ error:
 	lua_pushfstring(T, "error reading from SSL stream: %s", msg);
 
 	stream_io_unregister(s);
-	SSL_free(s->ssl);
-	s->ssl = NULL;
+	stream_ssl_free(s);
 	return 2;
 }
 
@@ -384,8 +816,7 @@ read_all_handler(EV_P_ struct ev_io *w, int revents)
 	if (ret == 0)
 		return;
 
-	lem_queue(s->T, ret);
-	s->T = NULL;
+	stream_done(s, ret);
 }
 
 static int
@@ -398,7 +829,7 @@ stream_read_all(lua_State *T, struct lem_ssl_stream *s)
 
 	s->T = T;
 	s->w.cb = read_all_handler;
-	return lua_yield(T, lua_gettop(T));
+	return 0;
 }
 
 /*
@@ -448,8 +879,7 @@ read_target_handler(EV_P_ struct ev_io *w, int revents)
 	if (ret == 0)
 		return;
 
-	lem_queue(s->T, ret);
-	s->T = NULL;
+	stream_done(s, ret);
 }
 
 static int
@@ -475,7 +905,7 @@ stream_read_target(lua_State *T, struct lem_ssl_stream *s)
 
 	s->T = T;
 	s->w.cb = read_target_handler;
-	return lua_yield(T, lua_gettop(T));
+	return 0;
 }
 
 /*
@@ -535,8 +965,7 @@ read_line_handler(EV_P_ struct ev_io *w, int revents)
 	if (ret == 0)
 		return;
 
-	lem_queue(s->T, ret);
-	s->T = NULL;
+	stream_done(s, ret);
 }
 
 static int
@@ -569,59 +998,684 @@ stream_read_line(lua_State *T, struct lem_ssl_stream *s)
 
 	s->T = T;
 	s->w.cb = read_line_handler;
-	return lua_yield(T, lua_gettop(T));
+	return 0;
 }
 
 /*
- * client:read() method
+ * read a length-prefixed frame
  */
-static int
-stream_read(lua_State *T)
+static unsigned long
+frame_length(struct lem_ssl_stream *s)
 {
-	struct lem_ssl_stream *s;
-	const char *mode;
+	const unsigned char *p = (const unsigned char *)s->readp;
 
-	luaL_checktype(T, 1, LUA_TUSERDATA);
+	if (s->in.header == 2) {
+		if (s->in.little)
+			return (unsigned long)p[0] | (unsigned long)p[1] << 8;
 
-	s = lua_touserdata(T, 1);
-	if (s->ssl == NULL) {
-		lua_pushnil(T);
-		lua_pushliteral(T, "closed");
-		return 2;
+		return (unsigned long)p[0] << 8 | (unsigned long)p[1];
 	}
 
-	if (s->T != NULL) {
-		lua_pushnil(T);
-		lua_pushliteral(T, "busy");
-		return 2;
-	}
+	if (s->in.little)
+		return (unsigned long)p[0]       | (unsigned long)p[1] << 8 |
+		       (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
 
-	if (lua_gettop(T) == 1) {
-		lua_settop(T, 0);
-		return stream_read_available(T, s);
+	return (unsigned long)p[0] << 24 | (unsigned long)p[1] << 16 |
+	       (unsigned long)p[2] << 8  | (unsigned long)p[3];
+}
+
+static int
+try_read_frame(lua_State *T, struct lem_ssl_stream *s)
+{
+	unsigned long len;
+	int size;
+
+	while ((size = s->writep - s->readp) < s->in.header) {
+		int ret;
+		int count = SSL_read(s->ssl, s->writep,
+		                     LEM_SSL_STREAM_BUFSIZE - (s->writep - s->buf));
+
+		lem_debug("read %d bytes", count);
+		ret = stream_check_error(T, s, count,
+		                         "error reading from SSL stream: %s");
+		if (ret != 1)
+			return ret;
+
+		s->writep += count;
+	}
+
+	len = frame_length(s);
+	lem_debug("frame of %lu bytes", len);
+	if (len > (unsigned long)s->in.max) {
+		stream_io_unregister(s);
+		lua_pushnil(T);
+		lua_pushliteral(T, "frame too large");
+		return 2;
+	}
+
+	s->readp += s->in.header;
+	size -= s->in.header;
+	s->in.target = (int)len;
+
+	if (size >= s->in.target) {
+		stream_io_unregister(s);
+		lua_pushlstring(T, s->readp, s->in.target);
+		s->readp += s->in.target;
+		if (s->readp == s->writep)
+			s->readp = s->writep = s->buf;
+		return 1;
+	}
+
+	/* the header is parsed, so the rest
+	 * is just reading the payload */
+	s->in.target -= size;
+	s->w.cb = read_target_handler;
+	return try_read_target(T, s);
+}
+
+static void
+read_frame_handler(EV_P_ struct ev_io *w, int revents)
+{
+	struct lem_ssl_stream *s = (struct lem_ssl_stream *)w;
+	int ret;
+
+	(void)revents;
+
+	ret = try_read_frame(s->T, s);
+	if (ret == 0)
+		return;
+
+	stream_done(s, ret);
+}
+
+/*
+ * client:readframe() method
+ */
+static int
+read_frame_start(lua_State *T, struct lem_ssl_stream *s)
+{
+	int format = (int)lua_tonumber(T, 2);
+	int ret;
+
+	s->in.parts = 0;
+	s->in.header = format < 2 ? 4 : 2;
+	s->in.little = format & 1;
+	s->in.max = (int)lua_tonumber(T, 3);
+
+	/* make room for the header */
+	if (s->readp > s->buf) {
+		size_t len = s->writep - s->readp;
+
+		memmove(s->buf, s->readp, len);
+		s->readp = s->buf;
+		s->writep = s->buf + len;
+	}
+
+	lua_settop(T, 0);
+
+	/* set the handler first since try_read_frame()
+	 * switches to read_target_handler once the
+	 * header is parsed */
+	s->w.cb = read_frame_handler;
+	ret = try_read_frame(T, s);
+	if (ret > 0)
+		return ret;
+
+	s->T = T;
+	return 0;
+}
+
+static int
+stream_readframe(lua_State *T)
+{
+	static const char *const formats[] = {
+		"u32be", "u32le", "u16be", "u16le", NULL
+	};
+	struct lem_ssl_stream *s;
+	int format;
+	lua_Number max;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	format = luaL_checkoption(T, 2, "u32be", formats);
+	max = luaL_optnumber(T, 3, LEM_SSL_FRAME_MAX);
+	luaL_argcheck(T, max >= 0 && max <= INT_MAX, 3, "invalid size");
+
+	s = lua_touserdata(T, 1);
+	if (s->ssl == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	lua_settop(T, 1);
+	lua_pushnumber(T, format);
+	lua_pushnumber(T, max);
+	return stream_start(T, s, read_frame_start);
+}
+
+/*
+ * decode a HTTP/1.1 chunked body
+ */
+#define CHUNK_SIZE    0
+#define CHUNK_DATA    1
+#define CHUNK_END     2
+#define CHUNK_TRAILER 3
+
+static void
+chunk_part(lua_State *T, struct lem_ssl_stream *s)
+{
+	/* don't let the pieces pile up on the stack */
+	if (++s->in.parts == 16) {
+		lua_concat(T, 16);
+		s->in.parts = 1;
+	}
+}
+
+static void
+chunk_push(lua_State *T, struct lem_ssl_stream *s,
+           const char *data, size_t len)
+{
+	lua_pushlstring(T, data, len);
+	chunk_part(T, s);
+}
+
+static int
+chunk_limit(struct lem_ssl_stream *s, int count)
+{
+	if ((unsigned long)count > s->chunked.left)
+		count = (int)s->chunked.left;
+	if (count > s->in.target)
+		count = s->in.target;
+	return count;
+}
+
+static int
+chunk_error(lua_State *T, struct lem_ssl_stream *s, const char *msg)
+{
+	stream_io_unregister(s);
+	s->chunked.state = CHUNK_SIZE;
+	lua_pushnil(T);
+	lua_pushstring(T, msg);
+	return 2;
+}
+
+/*
+ * handle the line from s->readp to the newline at p
+ * returns 0 to continue decoding
+ */
+static int
+chunk_line(lua_State *T, struct lem_ssl_stream *s, char *p)
+{
+	char *line = s->readp;
+	char *end = p;
+	unsigned long size;
+
+	if (end > line && end[-1] == '\r')
+		end--;
+
+	s->readp = p + 1;
+	if (s->readp == s->writep)
+		s->readp = s->writep = s->buf;
+
+	switch (s->chunked.state) {
+	case CHUNK_SIZE:
+		size = 0;
+		for (p = line; p < end && isxdigit((unsigned char)*p); p++) {
+			if (size > (ULONG_MAX >> 4))
+				return chunk_error(T, s, "chunk too large");
+
+			size = (size << 4) |
+			       (isdigit((unsigned char)*p) ? *p - '0' :
+			        (tolower((unsigned char)*p) - 'a' + 10));
+		}
+		/* chunk extensions are ignored */
+		if (p == line || (p < end && *p != ';' && *p != ' ' && *p != '\t'))
+			return chunk_error(T, s, "invalid chunk size");
+
+		lem_debug("chunk of %lu bytes", size);
+		if (size > 0) {
+			s->chunked.state = CHUNK_DATA;
+			s->chunked.left = size;
+			return 0;
+		}
+
+		/* hand over the data before the trailers */
+		s->chunked.state = CHUNK_TRAILER;
+		if (s->in.parts > 0) {
+			stream_io_unregister(s);
+			lua_concat(T, s->in.parts);
+			return 1;
+		}
+		return 0;
+
+	case CHUNK_END:
+		if (end != line)
+			return chunk_error(T, s, "invalid chunk end");
+
+		s->chunked.state = CHUNK_SIZE;
+		return 0;
+	}
+
+	/* CHUNK_TRAILER */
+	if (end != line) {
+		chunk_push(T, s, line, (p + 1) - line);
+		return 0;
+	}
+
+	/* the body is done, get ready for the next one */
+	stream_io_unregister(s);
+	s->chunked.state = CHUNK_SIZE;
+	if (s->in.parts == 0)
+		lua_pushliteral(T, "");
+	else
+		lua_concat(T, s->in.parts);
+	lua_pushliteral(T, "");
+	lua_insert(T, -2);
+	return 2;
+}
+
+/*
+ * read chunk data straight into a Lua buffer, only
+ * taking from s->buf what was read along with the size line
+ * returns 1 when the chunk or the target is used up,
+ * otherwise as stream_check_error()
+ */
+static int
+chunk_data(lua_State *T, struct lem_ssl_stream *s)
+{
+	luaL_Buffer b;
+	int got = 0;
+	int count;
+
+	luaL_buffinit(T, &b);
+
+	count = s->writep - s->readp;
+	if (count > 0) {
+		count = chunk_limit(s, count);
+		luaL_addlstring(&b, s->readp, count);
+		s->readp += count;
+		if (s->readp == s->writep)
+			s->readp = s->writep = s->buf;
+		s->in.target -= count;
+		s->chunked.left -= count;
+		got = count;
+	}
+
+	while (s->chunked.left > 0 && s->in.target > 0) {
+		count = SSL_read(s->ssl, luaL_prepbuffer(&b),
+		                 chunk_limit(s, LUAL_BUFFERSIZE));
+		lem_debug("read %d bytes", count);
+		if (count <= 0)
+			break;
+
+		luaL_addsize(&b, count);
+		s->in.target -= count;
+		s->chunked.left -= count;
+		got += count;
+	}
+
+	luaL_pushresult(&b);
+	if (got > 0)
+		chunk_part(T, s);
+	else
+		lua_pop(T, 1);
+
+	if (s->chunked.left == 0)
+		s->chunked.state = CHUNK_END;
+	if (count <= 0)
+		return stream_check_error(T, s, count,
+		                          "error reading from SSL stream: %s");
+	return 1;
+}
+
+static int
+try_read_chunked(lua_State *T, struct lem_ssl_stream *s)
+{
+	while (1) {
+		char *p;
+		int count;
+		int ret;
+
+		if (s->chunked.state == CHUNK_DATA) {
+			if (s->in.target == 0)
+				break;
+
+			ret = chunk_data(T, s);
+			if (ret == 1)
+				continue;
+			if (ret == 0 && s->in.parts > 0) {
+				/* return what we have rather than wait */
+				stream_io_unregister(s);
+				break;
+			}
+			return ret;
+		}
+
+		p = memchr(s->readp, '\n', s->writep - s->readp);
+		if (p != NULL) {
+			ret = chunk_line(T, s, p);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		/* make room for the rest of the line */
+		if (s->readp > s->buf) {
+			size_t len = s->writep - s->readp;
+
+			memmove(s->buf, s->readp, len);
+			s->readp = s->buf;
+			s->writep = s->buf + len;
+		}
+
+		count = LEM_SSL_STREAM_BUFSIZE - (s->writep - s->buf);
+		if (count == 0)
+			return chunk_error(T, s, "line too long");
+
+		count = SSL_read(s->ssl, s->writep, count);
+		lem_debug("read %d bytes", count);
+		ret = stream_check_error(T, s, count,
+		                         "error reading from SSL stream: %s");
+		if (ret == 0 && s->in.parts > 0 &&
+		    s->chunked.state != CHUNK_TRAILER) {
+			/* return what we have rather than wait */
+			stream_io_unregister(s);
+			break;
+		}
+		if (ret != 1)
+			return ret;
+
+		s->writep += count;
+	}
+
+	stream_io_unregister(s);
+	lua_concat(T, s->in.parts);
+	return 1;
+}
+
+static void
+read_chunked_handler(EV_P_ struct ev_io *w, int revents)
+{
+	struct lem_ssl_stream *s = (struct lem_ssl_stream *)w;
+	int ret;
+
+	(void)revents;
+
+	ret = try_read_chunked(s->T, s);
+	if (ret == 0)
+		return;
+
+	stream_done(s, ret);
+}
+
+static int
+read_chunked_start(lua_State *T, struct lem_ssl_stream *s)
+{
+	int ret;
+
+	s->in.parts = 0;
+	s->in.target = (int)lua_tonumber(T, 2);
+	lua_settop(T, 0);
+
+	ret = try_read_chunked(T, s);
+	if (ret > 0)
+		return ret;
+
+	s->T = T;
+	s->w.cb = read_chunked_handler;
+	return 0;
+}
+
+/*
+ * client:readchunked() method
+ */
+static int
+stream_readchunked(lua_State *T)
+{
+	struct lem_ssl_stream *s;
+	lua_Number max;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	max = luaL_optnumber(T, 2, LEM_SSL_CHUNKED_MAX);
+	luaL_argcheck(T, max >= 1 && max <= INT_MAX, 2, "invalid size");
+
+	s = lua_touserdata(T, 1);
+	if (s->ssl == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	lua_settop(T, 1);
+	lua_pushnumber(T, max);
+	return stream_start(T, s, read_chunked_start);
+}
+
+/*
+ * client:read() method
+ */
+static int
+read_start(lua_State *T, struct lem_ssl_stream *s)
+{
+	if (lua_gettop(T) == 1) {
+		lua_settop(T, 0);
+		return stream_read_available(T, s);
+	}
+
+	s->in.parts = 0;
+
+	if (lua_type(T, 2) == LUA_TNUMBER) {
+		s->in.target = (int)lua_tonumber(T, 2);
+		lua_settop(T, 0);
+		return stream_read_target(T, s);
+	}
+
+	if (lua_tostring(T, 2)[1] == 'a') {
+		lua_settop(T, 0);
+		return stream_read_all(T, s);
+	}
+
+	lua_settop(T, 0);
+	return stream_read_line(T, s);
+}
+
+static int
+stream_read(lua_State *T)
+{
+	struct lem_ssl_stream *s;
+	const char *mode;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+
+	if (lua_gettop(T) > 1) {
+		if (lua_isnumber(T, 2)) {
+			lua_Number target = lua_tonumber(T, 2);
+
+			lua_settop(T, 1);
+			lua_pushnumber(T, target);
+		} else {
+			mode = lua_tostring(T, 2);
+			if (mode == NULL || mode[0] != '*' ||
+			    (mode[1] != 'a' && mode[1] != 'l'))
+				return luaL_error(T, "invalid mode string");
+			lua_settop(T, 2);
+		}
+	}
+
+	s = lua_touserdata(T, 1);
+	if (s->ssl == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	return stream_start(T, s, read_start);
+}
+
+/*
+ * buffered output
+ */
+static void
+output_handler(EV_P_ struct ev_io *w, int revents)
+{
+	struct lem_ssl_output *out = (struct lem_ssl_output *)w;
+	struct lem_ssl_stream *s = out->s;
+	const char *fmt = "error writing to SSL stream: %s";
+	const char *msg;
+
+	(void)revents;
+
+	while (out->start < out->end) {
+		size_t len = out->end - out->start;
+		int count;
+
+		count = SSL_write(s->ssl, out->buf + out->start,
+		                  len > INT_MAX ? INT_MAX : (int)len);
+		lem_debug("flushed %d bytes", count);
+		switch (SSL_get_error(s->ssl, count)) {
+		case SSL_ERROR_NONE:
+			lem_debug("SSL_ERROR_NONE");
+			out->start += count;
+			continue;
+
+		case SSL_ERROR_ZERO_RETURN:
+			lem_debug("SSL_ERROR_ZERO_RETURN");
+			msg = NULL;
+			break;
+
+		case SSL_ERROR_WANT_READ:
+			lem_debug("SSL_ERROR_WANT_READ");
+			output_register(out, EV_READ);
+			goto out;
+
+		case SSL_ERROR_WANT_WRITE:
+			lem_debug("SSL_ERROR_WANT_WRITE");
+			output_register(out, EV_WRITE);
+			goto out;
+
+		case SSL_ERROR_SYSCALL:
+			lem_debug("SSL_ERROR_SYSCALL");
+			{
+				long e = ERR_get_error();
+
+				if (e)
+					msg = ERR_reason_error_string(e);
+				else if (count == 0)
+					msg = NULL;
+				else
+					msg = strerror(errno);
+			}
+			break;
+
+		case SSL_ERROR_SSL:
+			lem_debug("SSL_ERROR_SSL");
+			msg = ERR_reason_error_string(ERR_get_error());
+			break;
+
+		default:
+			lem_debug("SSL_ERROR_* (default)");
+			msg = "unexpected error from SSL library";
+			break;
+		}
+
+		/* the connection is broken, so wake
+		 * up everyone waiting on the stream */
+		if (msg == NULL)
+			fmt = "closed";
+		stream_wake(s, fmt, msg);
+		writer_wake(s, fmt, msg);
+		output_free(s, fmt, msg);
+		stream_ssl_free(s);
+		return;
+	}
+
+	out->start = out->end = 0;
+	output_unregister(out);
+
+out:
+	if (out->end - out->start <= out->wait)
+		output_wake(out, NULL, NULL);
+}
+
+static void
+output_kick(struct lem_ssl_stream *s)
+{
+	struct lem_ssl_output *out = s->out;
+
+	if (out->start == out->end || out->w.events)
+		return;
+
+	output_register(out, EV_WRITE);
+}
+
+static int
+output_append(struct lem_ssl_output *out, const char *data, size_t len)
+{
+	size_t pending = out->end - out->start;
+
+	if (out->size - out->end < len) {
+		/* openssl is told the buffer may
+		 * move between write retries */
+		if (out->start > 0) {
+			memmove(out->buf, out->buf + out->start, pending);
+			out->start = 0;
+			out->end = pending;
+		}
+
+		if (out->size - pending < len) {
+			size_t size = out->size ? out->size : LEM_SSL_STREAM_BUFSIZE;
+			char *buf;
+
+			while (size < pending + len)
+				size *= 2;
+
+			buf = realloc(out->buf, size);
+			if (buf == NULL)
+				return -1;
+
+			out->buf = buf;
+			out->size = size;
+		}
 	}
 
-	s->in.parts = 0;
+	memcpy(out->buf + out->end, data, len);
+	out->end += len;
+	return 0;
+}
 
-	if (lua_isnumber(T, 2)) {
-		s->in.target = (int)lua_tonumber(T, 2);
-		lua_settop(T, 0);
-		return stream_read_target(T, s);
+static int
+stream_write_buffered(lua_State *T, struct lem_ssl_stream *s)
+{
+	struct lem_ssl_output *out = s->out;
+	const char *data;
+	size_t len;
+
+	if (out->T != NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "busy");
+		return 2;
+	}
+
+	data = lua_tolstring(T, 2, &len);
+	if (output_append(out, data, len)) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "out of memory");
+		return 2;
 	}
 
-	mode = lua_tostring(T, 2);
-	if (mode == NULL || mode[0] != '*')
-		return luaL_error(T, "invalid mode string");
+	/* a running sendfile flushes the queue when done */
+	if (s->wr.T == NULL || s->wr.w.cb != sendfile_handler)
+		output_kick(s);
 
-	lua_settop(T, 0);
-	switch (mode[1]) {
-	case 'a':
-		return stream_read_all(T, s);
-	case 'l':
-		return stream_read_line(T, s);
+	if (out->end - out->start <= out->high) {
+		lua_pushboolean(T, 1);
+		return 1;
 	}
 
-	return luaL_error(T, "invalid mode string");
+	lem_debug("above high watermark, waiting..");
+	out->wait = out->low;
+	out->T = T;
+	return lua_yield(T, 0);
 }
 
 static int
@@ -632,7 +1686,7 @@ try_write(lua_State *T, struct lem_ssl_stream *s)
 		int count = SSL_write(s->ssl, s->write.buf, s->write.len);
 
 		lem_debug("wrote = %d bytes", count);
-		ret = stream_check_error(T, s, count,
+		ret = writer_check_error(T, s, count,
 		                         "error writing to SSL stream: %s");
 		if (ret != 1)
 			return ret;
@@ -641,7 +1695,7 @@ try_write(lua_State *T, struct lem_ssl_stream *s)
 		s->write.len -= count;
 	} while (s->write.len > 0);
 
-	stream_io_unregister(s);
+	writer_unregister(s);
 	lua_pushboolean(T, 1);
 	return 1;
 }
@@ -649,24 +1703,42 @@ try_write(lua_State *T, struct lem_ssl_stream *s)
 static void
 write_handler(EV_P_ struct ev_io *w, int revents)
 {
-	struct lem_ssl_stream *s = (struct lem_ssl_stream *)w;
+	struct lem_ssl_stream *s = ((struct lem_ssl_writer *)w)->s;
 	int ret;
 
 	(void)revents;
 
-	ret = try_write(s->T, s);
+	ret = try_write(s->wr.T, s);
 	if (ret == 0)
 		return;
 
-	lem_queue(s->T, ret);
-	s->T = NULL;
+	writer_done(s, ret);
+}
+
+static int
+write_start(lua_State *T, struct lem_ssl_stream *s)
+{
+	int ret;
+
+	s->write.buf = lua_tolstring(T, 2, &s->write.len);
+	if (s->write.len == 0) {
+		lua_pushboolean(T, 1);
+		return 1;
+	}
+
+	ret = try_write(T, s);
+	if (ret > 0)
+		return ret;
+
+	s->wr.T = T;
+	s->wr.w.cb = write_handler;
+	return 0;
 }
 
 static int
 stream_write(lua_State *T)
 {
 	struct lem_ssl_stream *s;
-	int ret;
 
 	luaL_checktype(T, 1, LUA_TUSERDATA);
 	luaL_checktype(T, 2, LUA_TSTRING);
@@ -678,24 +1750,459 @@ stream_write(lua_State *T)
 		return 2;
 	}
 
-	if (s->T != NULL) {
+	if (s->out != NULL)
+		return stream_write_buffered(T, s);
+
+	lua_settop(T, 2);
+	return writer_start(T, s, write_start);
+}
+
+/*
+ * client:buffer() method
+ */
+static int
+stream_buffer(lua_State *T)
+{
+	struct lem_ssl_stream *s;
+	lua_Number high;
+	lua_Number low;
+	struct lem_ssl_output *out;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	high = luaL_optnumber(T, 2, LEM_SSL_OUTPUT_HIGH);
+	luaL_argcheck(T, high >= 0, 2, "invalid size");
+	low = luaL_optnumber(T, 3, high / 4);
+	luaL_argcheck(T, low >= 0 && low <= high, 3, "invalid size");
+
+	s = lua_touserdata(T, 1);
+	if (s->ssl == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
+	out = s->out;
+	if (out == NULL) {
+		if (s->wr.T != NULL || s->wr.first != NULL) {
+			lua_pushnil(T);
+			lua_pushliteral(T, "busy");
+			return 2;
+		}
+
+		out = malloc(sizeof(struct lem_ssl_output));
+		if (out == NULL) {
+			lua_pushnil(T);
+			lua_pushliteral(T, "out of memory");
+			return 2;
+		}
+
+		ev_io_init(&out->w, output_handler, SSL_get_fd(s->ssl), 0);
+		out->s = s;
+		out->T = NULL;
+		out->buf = NULL;
+		out->size = out->start = out->end = out->wait = 0;
+		s->out = out;
+
+		/* let the queue grow and move between write retries */
+		SSL_set_mode(s->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+		                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	}
+
+	out->high = (size_t)high;
+	out->low = (size_t)low;
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * client:drain() method
+ */
+static int
+stream_drain(lua_State *T)
+{
+	struct lem_ssl_stream *s;
+	struct lem_ssl_output *out;
+	lua_Number size;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	size = luaL_optnumber(T, 2, 0);
+	luaL_argcheck(T, size >= 0, 2, "invalid size");
+
+	s = lua_touserdata(T, 1);
+	if (s->ssl == NULL) {
 		lua_pushnil(T);
-		lua_pushliteral(T, "busy");
+		lua_pushliteral(T, "closed");
 		return 2;
 	}
 
-	s->write.buf = lua_tolstring(T, 2, &s->write.len);
-	if (s->write.len == 0) {
+	out = s->out;
+	if (out == NULL || out->end - out->start <= (size_t)size) {
 		lua_pushboolean(T, 1);
 		return 1;
 	}
 
-	ret = try_write(T, s);
+	if (out->T != NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "busy");
+		return 2;
+	}
+
+	out->wait = (size_t)size;
+	out->T = T;
+	return lua_yield(T, 0);
+}
+
+/*
+ * send a file
+ */
+static void
+sendfile_close(struct lem_ssl_stream *s)
+{
+	if (s->sendfile.close)
+		close(s->sendfile.fd);
+
+	/* resume flushing data written while we were busy */
+	if (s->out != NULL)
+		output_kick(s);
+}
+
+static int
+try_sendfile_output(lua_State *T, struct lem_ssl_stream *s)
+{
+	struct lem_ssl_output *out = s->out;
+
+	while (out->start < out->end) {
+		size_t len = out->end - out->start;
+		int count;
+		int ret;
+
+		count = SSL_write(s->ssl, out->buf + out->start,
+		                  len > INT_MAX ? INT_MAX : (int)len);
+		lem_debug("flushed %d bytes", count);
+		ret = writer_check_error(T, s, count,
+		                         "error writing to SSL stream: %s");
+		if (ret != 1)
+			return ret;
+
+		out->start += count;
+	}
+
+	out->start = out->end = 0;
+	output_wake(out, NULL, NULL);
+	return 1;
+}
+
+static int
+try_sendfile(lua_State *T, struct lem_ssl_stream *s)
+{
+	if (s->out != NULL) {
+		int ret = try_sendfile_output(T, s);
+
+		if (ret != 1) {
+			if (ret == 2)
+				sendfile_close(s);
+			return ret;
+		}
+	}
+
+	while (1) {
+		int count;
+		int ret;
+
+		if (s->sendfile.len == 0) {
+			size_t size;
+			ssize_t bytes;
+
+			if (s->sendfile.remaining == 0)
+				break;
+
+#ifdef LEM_SSL_KTLS
+			if (BIO_get_ktls_send(SSL_get_wbio(s->ssl))) {
+				size = s->sendfile.remaining > INT_MAX ?
+					INT_MAX : (size_t)s->sendfile.remaining;
+
+				count = (int)SSL_sendfile(s->ssl, s->sendfile.fd,
+				                          s->sendfile.offset, size, 0);
+				lem_debug("sent %d bytes", count);
+				ret = writer_check_error(T, s, count,
+				                         "error writing to SSL stream: %s");
+				if (ret != 1) {
+					if (ret == 2)
+						sendfile_close(s);
+					return ret;
+				}
+
+				s->sendfile.offset += count;
+				s->sendfile.remaining -= count;
+				continue;
+			}
+#endif
+			size = s->sendfile.remaining > LEM_SSL_SENDFILE_BLOCKSIZE ?
+				LEM_SSL_SENDFILE_BLOCKSIZE : (size_t)s->sendfile.remaining;
+
+			bytes = pread(s->sendfile.fd, s->sendfile.block,
+			              size, s->sendfile.offset);
+			lem_debug("read %ld bytes from file", (long)bytes);
+			if (bytes <= 0) {
+				lua_pushnil(T);
+				lua_pushfstring(T, "error reading file: %s", bytes == 0 ?
+				                "unexpected end of file" : strerror(errno));
+				writer_unregister(s);
+				sendfile_close(s);
+				return 2;
+			}
+
+			s->sendfile.buf = s->sendfile.block;
+			s->sendfile.len = bytes;
+			s->sendfile.offset += bytes;
+			s->sendfile.remaining -= bytes;
+		}
+
+		count = SSL_write(s->ssl, s->sendfile.buf, s->sendfile.len);
+		lem_debug("wrote = %d bytes", count);
+		ret = writer_check_error(T, s, count,
+		                         "error writing to SSL stream: %s");
+		if (ret != 1) {
+			if (ret == 2)
+				sendfile_close(s);
+			return ret;
+		}
+
+		s->sendfile.buf += count;
+		s->sendfile.len -= count;
+	}
+
+	writer_unregister(s);
+	sendfile_close(s);
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+static void
+sendfile_handler(EV_P_ struct ev_io *w, int revents)
+{
+	struct lem_ssl_stream *s = ((struct lem_ssl_writer *)w)->s;
+	int ret;
+
+	(void)revents;
+
+	ret = try_sendfile(s->wr.T, s);
+	if (ret == 0)
+		return;
+
+	writer_done(s, ret);
+}
+
+static int
+sendfile_start(lua_State *T, struct lem_ssl_stream *s)
+{
+	const char *path = NULL;
+	int fd;
+	off_t offset = (off_t)lua_tonumber(T, 3);
+	off_t remaining = (off_t)lua_tonumber(T, 4);
+	int ret;
+
+	if (lua_type(T, 2) == LUA_TNUMBER)
+		fd = (int)lua_tonumber(T, 2);
+	else {
+		path = lua_tostring(T, 2);
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			lua_pushnil(T);
+			lua_pushfstring(T, "error opening '%s': %s",
+			                path, strerror(errno));
+			return 2;
+		}
+	}
+
+	s->sendfile.fd = fd;
+	s->sendfile.close = (path != NULL);
+
+	if (remaining < 0) {
+		struct stat st;
+
+		if (fstat(fd, &st)) {
+			lua_pushnil(T);
+			lua_pushfstring(T, "error reading file: %s",
+			                strerror(errno));
+			sendfile_close(s);
+			return 2;
+		}
+
+		remaining = st.st_size > offset ? st.st_size - offset : 0;
+	}
+
+	s->sendfile.buf = s->sendfile.block = NULL;
+	s->sendfile.len = 0;
+	s->sendfile.offset = offset;
+	s->sendfile.remaining = remaining;
+
+	/* data already written goes first, so stop
+	 * flushing it in the background */
+	if (s->out != NULL)
+		output_unregister(s->out);
+
+	/* the block buffer lives on our stack, so the
+	 * garbage collector frees it when we're done */
+	lua_settop(T, 1);
+	if (remaining > 0
+#ifdef LEM_SSL_KTLS
+	    && !BIO_get_ktls_send(SSL_get_wbio(s->ssl))
+#endif
+	   )
+		s->sendfile.block = lua_newuserdata(T, LEM_SSL_SENDFILE_BLOCKSIZE);
+
+	ret = try_sendfile(T, s);
 	if (ret > 0)
 		return ret;
 
-	s->T = T;
-	s->w.cb = write_handler;
+	s->wr.T = T;
+	s->wr.w.cb = sendfile_handler;
+	return 0;
+}
+
+static int
+stream_sendfile(lua_State *T)
+{
+	struct lem_ssl_stream *s;
+	lua_Number offset;
+	lua_Number remaining = -1;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	if (lua_type(T, 2) != LUA_TNUMBER)
+		(void)luaL_checkstring(T, 2);
+	offset = luaL_optnumber(T, 3, 0);
+	if (!lua_isnoneornil(T, 4))
+		remaining = luaL_checknumber(T, 4);
+
+	s = lua_touserdata(T, 1);
+	if (s->ssl == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "closed");
+		return 2;
+	}
+
 	lua_settop(T, 2);
-	return lua_yield(T, 2);
+	lua_pushnumber(T, offset);
+	lua_pushnumber(T, remaining);
+	return writer_start(T, s, sendfile_start);
+}
+
+static int
+stream_stats(lua_State *T)
+{
+	struct lem_ssl_stream *s;
+	struct lem_ssl_stats *st;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	s = lua_touserdata(T, 1);
+	st = &s->stats;
+
+	lua_createtable(T, 0, 7);
+	lua_pushnumber(T, st->recv);
+	lua_setfield(T, -2, "recv");
+	lua_pushnumber(T, st->received);
+	lua_setfield(T, -2, "received");
+	lua_pushnumber(T, st->send);
+	lua_setfield(T, -2, "send");
+	lua_pushnumber(T, st->sent);
+	lua_setfield(T, -2, "sent");
+	lua_pushnumber(T, st->received ?
+	                  st->recv * 1048576.0 / st->received : 0);
+	lua_setfield(T, -2, "recvpermb");
+	lua_pushnumber(T, st->hsreceived);
+	lua_setfield(T, -2, "handshakereceived");
+	lua_pushnumber(T, st->hssent);
+	lua_setfield(T, -2, "handshakesent");
+	return 1;
+}
+
+static int
+stream_queue(lua_State *T)
+{
+	struct lem_ssl_stream *s;
+
+	luaL_checktype(T, 1, LUA_TUSERDATA);
+	s = lua_touserdata(T, 1);
+	s->queue = lua_isnone(T, 2) || lua_toboolean(T, 2);
+
+	lua_pushboolean(T, 1);
+	return 1;
+}
+
+/*
+ * non-yielding attempts for foreign function interfaces
+ */
+static int
+try_status(struct lem_ssl_stream *s, int ret)
+{
+	switch (SSL_get_error(s->ssl, ret)) {
+	case SSL_ERROR_WANT_READ:
+		return LEM_SSL_WANT_READ;
+
+	case SSL_ERROR_WANT_WRITE:
+	case SSL_ERROR_WANT_CONNECT:
+		return LEM_SSL_WANT_WRITE;
+
+	case SSL_ERROR_ZERO_RETURN:
+		return LEM_SSL_CLOSED;
+	}
+
+	/* leave the stream open so the yielding methods
+	 * can report it, but don't leave the error queue
+	 * behind for the next stream to trip over */
+	ERR_clear_error();
+	return LEM_SSL_ERROR;
+}
+
+int
+lem_ssl_tryread(struct lem_ssl_stream *s, char *buf, int len)
+{
+	int size;
+
+	if (s->ssl == NULL)
+		return LEM_SSL_CLOSED;
+
+	if (s->T != NULL)
+		return LEM_SSL_BUSY;
+
+	size = s->writep - s->readp;
+	if (size > 0) {
+		if (size > len)
+			size = len;
+
+		memcpy(buf, s->readp, size);
+		s->readp += size;
+		if (s->readp == s->writep)
+			s->readp = s->writep = s->buf;
+		return size;
+	}
+
+	size = SSL_read(s->ssl, buf, len);
+	if (size > 0)
+		return size;
+
+	return try_status(s, size);
+}
+
+int
+lem_ssl_trywrite(struct lem_ssl_stream *s, const char *buf, int len)
+{
+	int count;
+
+	if (s->ssl == NULL)
+		return LEM_SSL_CLOSED;
+
+	if (s->wr.T != NULL || s->out != NULL)
+		return LEM_SSL_BUSY;
+
+	if (len == 0)
+		return 0;
+
+	count = SSL_write(s->ssl, buf, len);
+	if (count > 0)
+		return count;
+
+	return try_status(s, count);
 }
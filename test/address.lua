@@ -0,0 +1,106 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+--
+-- Test how context:connect() and context:listen() split addresses
+-- into host and port, including IPv6 addresses in brackets.
+-- Nothing but the loopback interface is used, and the IPv6
+-- connection is skipped if ::1 isn't available.
+--
+-- Usage: test/address.lua [port]
+--
+
+local test = dofile(arg[0]:match('^(.-)[^/]*$') .. 'util.lua')
+
+local check, greet = test.check, test.greet
+local port = test.port(24433)
+local context = test.context()
+
+local function connected(name, ...)
+	local conn, err = context:connect(...)
+
+	check(name, conn and conn:read(3) or err, 'hi\n')
+	if conn then conn:close() end
+end
+
+do
+	local server, err = context:listen('[127.0.0.1]:' .. port)
+
+	check('listen on [127.0.0.1]:port', server and true or err, true)
+	if server then
+		greet(server)
+		connected('connect to host:port', '127.0.0.1:' .. port)
+		connected('connect to [host]:port', '[127.0.0.1]:' .. port)
+		connected('connect to [host] with port argument', '[127.0.0.1]', port)
+		connected('port argument before port in address',
+			'[127.0.0.1]:1', port)
+		server:close()
+	end
+end
+
+do
+	local server = context:listen('[::1]:' .. port)
+
+	if server then
+		greet(server)
+		connected('connect to [::1]:port', '[::1]:' .. port)
+		server:close()
+	else
+		print('skip connect to [::1]:port, no IPv6 loopback')
+	end
+end
+
+for _, t in ipairs{
+	{ '[::1]', 'no port specified' },
+	{ '::1', 'no port specified' },
+	{ 'fe80::1:443', 'no port specified' },
+	{ 'localhost', 'no port specified' },
+	{ '[::1]:nosuchport', "error looking up '::1': " },
+	{ '[fe80::1%lo]:nosuchport', "error looking up 'fe80::1%lo': " },
+	{ '[127.0.0.1]:nosuchport', "error looking up '127.0.0.1': " },
+	{ 'localhost:nosuchport', "error looking up 'localhost': " },
+} do
+	local address, msg = t[1], t[2]
+	local conn, err = context:connect(address)
+
+	-- lookup errors end with a message from the system
+	check('connect to ' .. address .. ': result', conn, nil)
+	check('connect to ' .. address .. ': error',
+		(err or ''):sub(1, #msg), msg)
+end
+
+do
+	local server, err = context:listen('[::1]')
+
+	check('listen on [::1]: result', server, nil)
+	check('listen on [::1]: error', err, 'no port specified')
+end
+
+do
+	local ok, err = pcall(context.connect, context,
+		('a'):rep(2000) .. ':443')
+
+	check('host too long: result', ok, false)
+	check('host too long: error',
+		err:find('invalid address', 1, true) ~= nil, true)
+end
+
+test.done()
+
+-- vim: ts=2 sw=2 noet:
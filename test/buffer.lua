@@ -0,0 +1,160 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+--
+-- Test buffered writing with stream:buffer() and stream:drain()
+-- over the loopback interface.
+--
+-- Usage: test/buffer.lua [port]
+--
+
+local utils = require 'lem.utils'
+
+local test = dofile(arg[0]:match('^(.-)[^/]*$') .. 'util.lua')
+
+local check = test.check
+local port = test.port(24435)
+local context = test.context()
+local server = assert(context:listen('127.0.0.1', port))
+
+-- numbered lines, so lost or reordered data shows
+local function lines(first, last)
+	local t = {}
+	for i = first, last do
+		t[#t + 1] = string.format('%063d\n', i)
+	end
+	return table.concat(t)
+end
+
+-- run writer on the server side of a new connection
+-- and return the client side
+local function serve(writer)
+	utils.spawn(function()
+		local conn = assert(server:accept())
+
+		writer(conn)
+		conn:close()
+	end)
+
+	return assert(context:connect('127.0.0.1', port))
+end
+
+do
+	local data = lines(1, 32768)
+	local results = {}
+	local conn = serve(function(conn)
+		results.buffer = conn:buffer()
+		for i = 1, 32768, 64 do
+			results.write = assert(conn:write(lines(i, i + 63)))
+		end
+		results.drain = conn:drain()
+	end)
+
+	check('default watermarks: 2MB arrive in order',
+		conn:read(#data), data)
+	check('default watermarks: buffer', results.buffer, true)
+	check('default watermarks: write', results.write, true)
+	check('default watermarks: drain', results.drain, true)
+	conn:close()
+end
+
+do
+	local data = lines(1, 4096)
+	local conn = serve(function(conn)
+		assert(conn:buffer(4096, 1024))
+		assert(conn:write(data:sub(1, 100000)))
+		assert(conn:write(data:sub(100001)))
+		assert(conn:drain())
+	end)
+
+	check('small watermarks: writes above high',
+		conn:read(#data), data)
+	conn:close()
+end
+
+do
+	local data = lines(1, 16)
+	local conn = serve(function(conn)
+		assert(conn:buffer())
+		assert(conn:write(data))
+
+		-- the queue is empty once drained, so closing loses nothing
+		local ok, err = conn:drain()
+		check('drain before close', ok or err, true)
+	end)
+
+	check('drain before close: data', conn:read(#data), data)
+	conn:close()
+end
+
+do
+	local data = lines(1, 1024)
+	local conn = serve(function(conn)
+		local sleeper = utils.sleeper()
+		local got
+
+		assert(conn:buffer())
+
+		-- a read waiting in another coroutine
+		-- doesn't hold back buffered writes
+		utils.spawn(function()
+			got = conn:read(5)
+		end)
+		sleeper:sleep(0.01)
+		assert(conn:write(data))
+		assert(conn:drain())
+		while got == nil do
+			sleeper:sleep(0.01)
+		end
+		assert(conn:write(got))
+		assert(conn:drain())
+	end)
+
+	check('write while reading: data', conn:read(#data), data)
+	assert(conn:write('ping\n'))
+	check('write while reading: echo', conn:read(5), 'ping\n')
+	conn:close()
+end
+
+do
+	local conn = serve(function(conn)
+		local ok, err = pcall(conn.buffer, conn, -1)
+		check('negative high watermark',
+			not ok and err:find('invalid size', 1, true) ~= nil, true)
+
+		ok, err = pcall(conn.buffer, conn, 100, 200)
+		check('low above high',
+			not ok and err:find('invalid size', 1, true) ~= nil, true)
+
+		ok, err = pcall(conn.drain, conn, -1)
+		check('negative drain size',
+			not ok and err:find('invalid size', 1, true) ~= nil, true)
+
+		check('drain unbuffered stream', conn:drain(), true)
+		assert(conn:write('done\n'))
+	end)
+
+	check('argument errors', conn:read(5), 'done\n')
+	conn:close()
+end
+
+server:close()
+test.done()
+
+-- vim: ts=2 sw=2 noet:
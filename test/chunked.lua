@@ -0,0 +1,140 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+--
+-- Test stream:readchunked() against a local server sending
+-- the raw body in pieces, each arriving in a separate read.
+--
+-- Usage: test/chunked.lua [port]
+--
+
+local test = dofile(arg[0]:match('^(.-)[^/]*$') .. 'util.lua')
+
+local check = test.check
+local context = test.context()
+local server, serve = test.server(context, test.port(24431))
+
+-- read a whole body and return the data and trailers,
+-- or nil, the error and the data read before it
+local function body(conn, max)
+	local data = {}
+
+	while true do
+		local chunk, trailers = conn:readchunked(max)
+		if not chunk then
+			return nil, trailers, table.concat(data)
+		end
+		if chunk == '' then
+			return table.concat(data), trailers
+		end
+		if max and #chunk > max then
+			return nil, 'more than max', table.concat(data)
+		end
+		data[#data + 1] = chunk
+	end
+end
+
+for _, t in ipairs{
+	{ 'single chunk',
+		{ '5\r\nhello\r\n0\r\n\r\n' },
+		'hello', '' },
+	{ 'several chunks',
+		{ '5\r\nhello\r\n1\r\n \r\n5\r\nworld\r\n0\r\n\r\n' },
+		'hello world', '' },
+	{ 'upper and lower case hex',
+		{ 'A\r\n0123456789\r\nb\r\nabcdefghijk\r\n0\r\n\r\n' },
+		'0123456789abcdefghijk', '' },
+	{ 'bare newlines',
+		{ '3\nabc\n0\n\n' },
+		'abc', '' },
+	{ 'chunk extensions',
+		{ '5;name=value\r\nhello\r\n6 ; x="y"\r\n world\r\n0;last\r\n\r\n' },
+		'hello world', '' },
+	{ 'trailers',
+		{ '3\r\nabc\r\n0\r\nExpires: never\r\nX-Sum: 42\r\n\r\n' },
+		'abc', 'Expires: never\r\nX-Sum: 42\r\n' },
+	{ 'straddling reads',
+		{ '1', '0\r\n0123456', '789abcdef\r', '\n0\r', '\nX-A: b', '\r\n\r\n' },
+		'0123456789abcdef', 'X-A: b\r\n' },
+	{ 'large chunk',
+		{ '4000\r\n' .. ('x'):rep(8192), ('y'):rep(8192) .. '\r\n0\r\n\r\n' },
+		('x'):rep(8192) .. ('y'):rep(8192), '' },
+} do
+	local name, pieces, data, trailers = t[1], t[2], t[3], t[4]
+	local conn = serve(pieces)
+	local got, err = body(conn)
+
+	check(name .. ': data', got, data)
+	check(name .. ': trailers', err, trailers)
+	conn:close()
+end
+
+do
+	local conn = serve{ '10\r\n0123456789abcdef\r\n0\r\n\r\n' }
+	local got = body(conn, 5)
+
+	check('max: data', got, '0123456789abcdef')
+	conn:close()
+end
+
+do
+	local conn = serve{
+		'3\r\nfoo\r\n0\r\n\r\n',
+		'3\r\nbar\r\n0\r\nX-B: c\r\n\r\n',
+	}
+	local first, firsttrailers = body(conn)
+	local second, secondtrailers = body(conn)
+
+	check('keep-alive: first data', first, 'foo')
+	check('keep-alive: first trailers', firsttrailers, '')
+	check('keep-alive: second data', second, 'bar')
+	check('keep-alive: second trailers', secondtrailers, 'X-B: c\r\n')
+	conn:close()
+end
+
+for _, t in ipairs{
+	{ 'malformed hex', { 'zz\r\n' },
+		'invalid chunk size', '' },
+	{ 'junk after size', { '5x\r\nhello\r\n0\r\n\r\n' },
+		'invalid chunk size', '' },
+	{ 'empty size line', { '\r\n' },
+		'invalid chunk size', '' },
+	{ 'size too large', { '11111111111111111\r\n' },
+		'chunk too large', '' },
+	{ 'chunk too long', { '3\r\nabcd\r\n0\r\n\r\n' },
+		'invalid chunk end', '' },
+	{ 'chunk end after data', { '3\r\nabc', 'x\r\n0\r\n\r\n' },
+		'invalid chunk end', 'abc' },
+	{ 'line too long', { '1;' .. ('x'):rep(2000) .. '\r\n' },
+		'line too long', '' },
+} do
+	local name, pieces, msg, data = t[1], t[2], t[3], t[4]
+	local conn = serve(pieces)
+	local got, err, before = body(conn)
+
+	check(name .. ': result', got, nil)
+	check(name .. ': error', err, msg)
+	check(name .. ': data before', before, data)
+	conn:close()
+end
+
+server:close()
+test.done()
+
+-- vim: ts=2 sw=2 noet:
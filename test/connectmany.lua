@@ -0,0 +1,115 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+--
+-- Test context:connectmany() against a local server, with many
+-- connections to the same host sharing one lookup.
+--
+-- Usage: test/connectmany.lua [port]
+--
+
+local test = dofile(arg[0]:match('^(.-)[^/]*$') .. 'util.lua')
+
+local check = test.check
+local port = test.port(24436)
+local context = test.context()
+local server = assert(context:listen('127.0.0.1', port))
+
+test.greet(server)
+
+-- count the streams greeting and the errors starting with msg
+local function results(streams, errors, msg)
+	local greeted, failed = 0, 0
+
+	for _, conn in pairs(streams) do
+		if conn:read(3) == 'hi\n' then
+			greeted = greeted + 1
+		end
+		conn:close()
+	end
+	for _, err in pairs(errors) do
+		if msg and err:sub(1, #msg) == msg then
+			failed = failed + 1
+		end
+	end
+	return greeted, failed
+end
+
+for _, t in ipairs{
+	{ 'same address', nil },
+	{ 'same address, concurrency 1', 1 },
+	{ 'same address, concurrency 4', 4 },
+} do
+	local name, concurrency = t[1], t[2]
+	local addresses = {}
+	for i = 1, 50 do
+		addresses[i] = '127.0.0.1:' .. port
+	end
+
+	local streams, errors = context:connectmany(addresses, concurrency)
+	local greeted = results(streams, errors)
+
+	check(name .. ': connected', greeted, 50)
+	check(name .. ': errors', next(errors), nil)
+end
+
+do
+	local addresses = {}
+	for i = 1, 20 do
+		addresses[i] = (i % 2 == 0 and '127.0.0.1:' or '[127.0.0.1]:') .. port
+	end
+	addresses[21] = '127.0.0.1:nosuchport'
+	addresses[22] = '127.0.0.1:nosuchport'
+	addresses[23] = '127.0.0.1'
+
+	local streams, errors = context:connectmany(addresses, 5)
+	local greeted, failed = results(streams, errors,
+		"error looking up '127.0.0.1': ")
+
+	check('mixed: connected', greeted, 20)
+	check('mixed: lookup errors', failed, 2)
+	check('mixed: no port', errors[23], 'no port specified')
+	check('mixed: failed have no stream',
+		streams[21] == nil and streams[22] == nil and streams[23] == nil, true)
+end
+
+do
+	local streams, errors = context:connectmany{}
+
+	check('empty: streams', next(streams), nil)
+	check('empty: errors', next(errors), nil)
+end
+
+do
+	local ok, err = pcall(context.connectmany, context, { 42 })
+
+	check('not an address: result', ok, false)
+	check('not an address: error',
+		err:find('expected table of addresses', 1, true) ~= nil, true)
+
+	ok, err = pcall(context.connectmany, context, {}, -1)
+	check('negative concurrency: result', ok, false)
+	check('negative concurrency: error',
+		err:find('invalid concurrency', 1, true) ~= nil, true)
+end
+
+server:close()
+test.done()
+
+-- vim: ts=2 sw=2 noet:
@@ -0,0 +1,114 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+--
+-- Test stream:readframe() against a local server sending
+-- the raw frames in pieces, each arriving in a separate read.
+--
+-- Usage: test/frame.lua [port]
+--
+
+local test = dofile(arg[0]:match('^(.-)[^/]*$') .. 'util.lua')
+
+local check = test.check
+local context = test.context()
+local server, serve = test.server(context, test.port(24432))
+
+local big = ('0123456789abcdef'):rep(6250)
+
+-- name, format, max, pieces and the frames expected
+for _, t in ipairs{
+	{ 'u32be', 'u32be', nil, { '\0\0\0\5hello' }, { 'hello' } },
+	{ 'u32le', 'u32le', nil, { '\5\0\0\0hello' }, { 'hello' } },
+	{ 'u16be', 'u16be', nil, { '\0\5hello' }, { 'hello' } },
+	{ 'u16le', 'u16le', nil, { '\5\0hello' }, { 'hello' } },
+	{ 'default format', nil, nil, { '\0\0\1\0' .. ('x'):rep(256) },
+		{ ('x'):rep(256) } },
+	{ 'empty payload', 'u32be', nil, { '\0\0\0\0' }, { '' } },
+	{ 'length equal to max', 'u32be', 5, { '\0\0\0\5hello' }, { 'hello' } },
+	{ 'header straddling reads', 'u32be', nil, { '\0\0', '\0\5he', 'llo' },
+		{ 'hello' } },
+	{ 'payload straddling reads', 'u16le', nil,
+		{ '\0\4' .. ('x'):rep(600), ('y'):rep(424) },
+		{ ('x'):rep(600) .. ('y'):rep(424) } },
+	{ 'large frame', 'u32be', nil,
+		{ '\0\1\134\160' .. big:sub(1, 30000), big:sub(30001, 60000),
+		  big:sub(60001) },
+		{ big } },
+	{ 'several frames in one read', 'u16be', nil,
+		{ '\0\3abc\0\2de\0\0\0\1f' },
+		{ 'abc', 'de', '', 'f' } },
+	{ 'frames straddling reads', 'u16le', nil,
+		{ '\3\0ab', 'c\2', '\0de\1', '\0f' },
+		{ 'abc', 'de', 'f' } },
+} do
+	local name, format, max, pieces, expected = t[1], t[2], t[3], t[4], t[5]
+	local conn = serve(pieces)
+
+	for i, frame in ipairs(expected) do
+		local got, err = conn:readframe(format, max)
+		check(name .. ': frame ' .. i, got or err, frame)
+	end
+	conn:close()
+end
+
+do
+	local conn = serve{ '\0\0\0\5hello' }
+	local got, err = conn:readframe('u32be', 4)
+
+	check('frame too large: result', got, nil)
+	check('frame too large: error', err, 'frame too large')
+	check('frame too large: header left unread',
+		conn:readframe('u32be', 5), 'hello')
+	conn:close()
+end
+
+do
+	local conn = serve{ '\255\255\255\255' }
+	local got, err = conn:readframe()
+
+	check('header above default max: result', got, nil)
+	check('header above default max: error', err, 'frame too large')
+	conn:close()
+end
+
+do
+	local conn = serve{ '\0\3abcxyz\n' }
+
+	check('frame then read: frame', conn:readframe('u16be'), 'abc')
+	check('frame then read: rest', conn:read(4), 'xyz\n')
+	conn:close()
+end
+
+do
+	local conn = serve{ '\0\3abc' }
+	local ok, err = pcall(conn.readframe, conn, 'u64be')
+
+	check('invalid format: result', ok, false)
+	check('invalid format: error',
+		err:find("invalid option 'u64be'", 1, true) ~= nil, true)
+	check('invalid format: stream still usable',
+		conn:readframe('u16be'), 'abc')
+	conn:close()
+end
+
+server:close()
+test.done()
+
+-- vim: ts=2 sw=2 noet:
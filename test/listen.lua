@@ -0,0 +1,78 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+--
+-- Test that servers only share a port when listening
+-- with the reuseport argument of context:listen().
+--
+-- Usage: test/listen.lua [port]
+--
+
+local test = dofile(arg[0]:match('^(.-)[^/]*$') .. 'util.lua')
+
+local check = test.check
+local port = test.port(24437)
+local context = test.context()
+
+do
+	local server = assert(context:listen('127.0.0.1', port))
+	local other, err = context:listen('127.0.0.1', port)
+
+	check('port in use: result', other, nil)
+	check('port in use: error', (err or ''):sub(1, 16), 'error listening:')
+	if other then other:close() end
+	server:close()
+end
+
+do
+	local server = assert(context:listen('127.0.0.1', port, nil, true))
+	local other, err = context:listen('127.0.0.1', port)
+
+	check('only first with reuseport: result', other, nil)
+	check('only first with reuseport: error',
+		(err or ''):sub(1, 16), 'error listening:')
+	if other then other:close() end
+	server:close()
+end
+
+do
+	local server, err = context:listen('127.0.0.1', port, nil, true)
+
+	if server then
+		local other, err = context:listen('127.0.0.1', port, nil, true)
+
+		check('both with reuseport', other and true or err, true)
+		if other then
+			-- connections reach one of the servers
+			test.greet(server)
+			test.greet(other)
+			local conn = assert(context:connect('127.0.0.1', port))
+			check('both with reuseport: connect', conn:read(3), 'hi\n')
+			conn:close()
+			other:close()
+		end
+		server:close()
+	else
+		check('reuseport: error', err, 'SO_REUSEPORT not supported')
+	end
+end
+
+test.done()
+
+-- vim: ts=2 sw=2 noet:
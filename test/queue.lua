@@ -0,0 +1,193 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+--
+-- Test that reads and writes from several coroutines take turns
+-- in separate queues, so a waiting read never holds back writes.
+--
+-- Usage: test/queue.lua [port]
+--
+
+local utils = require 'lem.utils'
+
+local test = dofile(arg[0]:match('^(.-)[^/]*$') .. 'util.lua')
+
+local check = test.check
+local port = test.port(24440)
+local context = test.context()
+local server = assert(context:listen('127.0.0.1', port))
+local sleeper = utils.sleeper()
+
+-- more than the socket buffers hold, so
+-- writing it blocks until the peer reads
+local big = ('x'):rep(32 * 1024 * 1024)
+
+-- run handler on the server side of a new connection
+-- and return the client side
+local function serve(handler)
+	utils.spawn(function()
+		local conn = assert(server:accept())
+
+		handler(conn)
+		conn:close()
+	end)
+
+	return assert(context:connect('127.0.0.1', port))
+end
+
+-- send back everything received
+local function echo(conn)
+	while true do
+		local data = conn:read()
+		if not data or not conn:write(data) then break end
+	end
+end
+
+-- run f in a new coroutine and return a table
+-- getting its results once it's done
+local function spawn(f, ...)
+	local results = {}
+	local args = { ... }
+
+	utils.spawn(function()
+		results.values = { f(unpack(args)) }
+	end)
+	return results
+end
+
+-- let the other coroutines run until
+-- they're all waiting for IO
+local function settle()
+	sleeper:sleep(0.05)
+end
+
+do
+	local conn = serve(echo)
+	local reading = spawn(conn.read, conn, '*l')
+
+	settle()
+	check('write while reading: busy', conn:busy(), true)
+	check('write while reading: write', conn:write('ping\n'), true)
+	settle()
+	check('write while reading: read',
+		reading.values and reading.values[1], 'ping\n')
+
+	reading = spawn(conn.read, conn, '*l')
+	settle()
+	local ok, err = conn:read()
+	check('second read without queue: result', ok, nil)
+	check('second read without queue: error', err, 'busy')
+	check('write with read still waiting', conn:write('pong\n'), true)
+	settle()
+	check('first read unaffected',
+		reading.values and reading.values[1], 'pong\n')
+	conn:close()
+end
+
+do
+	-- the server doesn't read, so the big write blocks
+	local conn = serve(function(conn)
+		conn:read(3)
+	end)
+	local writing = spawn(conn.write, conn, big)
+
+	settle()
+	check('blocked write: busy', conn:busy(), true)
+	local ok, err = conn:write('more')
+	check('second write without queue: result', ok, nil)
+	check('second write without queue: error', err, 'busy')
+
+	local reading = spawn(conn.read, conn)
+	settle()
+	check('read while writing: not busy', reading.values, nil)
+
+	check('close: result', conn:close(), true)
+	settle()
+	check('close: blocked write',
+		writing.values and writing.values[2], 'interrupted')
+	check('close: waiting read',
+		reading.values and reading.values[2], 'interrupted')
+end
+
+do
+	local conn = serve(echo)
+	local lines = {}
+
+	conn:queue()
+	for i = 1, 20 do
+		lines[i] = spawn(conn.read, conn, '*l')
+	end
+	for i = 1, 20 do
+		spawn(conn.write, conn, 'line ' .. i .. '\n')
+	end
+	settle()
+
+	local got = 0
+	for i = 1, 20 do
+		if lines[i].values and lines[i].values[1] == 'line ' .. i .. '\n' then
+			got = got + 1
+		end
+	end
+	check('queued reads and writes in order', got, 20)
+	conn:close()
+end
+
+do
+	local conn = serve(function(conn)
+		conn:read(3)
+	end)
+
+	conn:queue()
+	local writing = spawn(conn.write, conn, big)
+	local queued = spawn(conn.write, conn, 'queued')
+	local reading = spawn(conn.read, conn)
+	local waiting = spawn(conn.read, conn)
+
+	settle()
+	check('interrupt: result', conn:interrupt(), true)
+	settle()
+	check('interrupt: blocked write',
+		writing.values and writing.values[2], 'interrupted')
+	check('interrupt: queued write',
+		queued.values and queued.values[2], 'interrupted')
+	check('interrupt: read', reading.values and reading.values[2],
+		'interrupted')
+	check('interrupt: queued read', waiting.values and waiting.values[2],
+		'interrupted')
+
+	local ok, err = conn:interrupt()
+	check('interrupt again: result', ok, nil)
+	check('interrupt again: error', err, 'not busy')
+	check('interrupt: not busy', conn:busy(), false)
+
+	reading = spawn(conn.read, conn)
+	waiting = spawn(conn.read, conn)
+	settle()
+	conn:close()
+	settle()
+	check('close: read', reading.values and reading.values[2],
+		'interrupted')
+	check('close: queued read', waiting.values and waiting.values[2],
+		'closed')
+end
+
+server:close()
+test.done()
+
+-- vim: ts=2 sw=2 noet:
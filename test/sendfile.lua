@@ -0,0 +1,98 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+--
+-- Test stream:sendfile() over the loopback interface, both through
+-- userspace and with kTLS when the system supports it.
+--
+-- Usage: test/sendfile.lua [port]
+--
+
+local utils = require 'lem.utils'
+
+local test = dofile(arg[0]:match('^(.-)[^/]*$') .. 'util.lua')
+
+local check = test.check
+local port = test.port(24434)
+
+-- several blocks of numbered lines, so misplaced data shows
+local data = {}
+for i = 1, 12500 do
+	data[i] = string.format('%015d\n', i)
+end
+data = table.concat(data)
+
+local path = os.tmpname()
+do
+	local file = assert(io.open(path, 'w'))
+	assert(file:write(data))
+	file:close()
+end
+
+local function run(name, context)
+	local server = assert(context:listen('127.0.0.1', port))
+
+	utils.spawn(function()
+		local conn = assert(server:accept())
+
+		assert(conn:write('<'))
+		assert(conn:sendfile(path))
+		assert(conn:write('>'))
+		assert(conn:sendfile(path, 1000))
+		assert(conn:sendfile(path, 70000, 5000))
+		assert(conn:sendfile(path, #data + 10))
+
+		local ok, err = conn:sendfile(path .. '.missing')
+		conn:write((ok and 'no error' or err) .. '\n')
+		conn:close()
+	end)
+
+	local conn = assert(context:connect('127.0.0.1', port))
+
+	check(name .. ': whole file between writes',
+		conn:read(#data + 2), '<' .. data .. '>')
+	check(name .. ': from offset',
+		conn:read(#data - 1000), data:sub(1001))
+	check(name .. ': offset and length',
+		conn:read(5000), data:sub(70001, 75000))
+	check(name .. ': missing file',
+		conn:read('*l'), "error opening '" .. path ..
+		".missing': No such file or directory\n")
+
+	conn:close()
+	server:close()
+end
+
+run('userspace', test.context())
+
+do
+	local context = test.context()
+	local ok, err = context:ktls()
+
+	if ok then
+		run('ktls', context)
+	else
+		check('ktls: error', err, 'kTLS not supported')
+	end
+end
+
+os.remove(path)
+test.done()
+
+-- vim: ts=2 sw=2 noet:
@@ -0,0 +1,97 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+--
+-- Test that servers pick the certificate added with context:addhost()
+-- for the name a client asks for. The servers default to the
+-- certificate for other.test, and the client only trusts the one
+-- for localhost, so it only gets through when that one was picked.
+--
+-- Usage: test/sni.lua [port]
+--
+
+local ssl = require 'lem.ssl'
+
+local test = dofile(arg[0]:match('^(.-)[^/]*$') .. 'util.lua')
+
+local check = test.check
+local port = test.port(24438)
+local dir = test.dir
+
+local client = test.context()
+assert(client:verify(dir .. 'cert.pem', nil, 0))
+
+-- start a server set up by setup and return it, its context and a function
+-- checking whether a client asking for localhost gets through to it
+local function serve(setup)
+	local context = assert(ssl.newcontext())
+	assert(context:usecertificate(dir .. 'othercert.pem',
+		dir .. 'otherkey.pem'))
+	setup(context)
+
+	local server = assert(context:listen('127.0.0.1', port))
+	test.greet(server)
+
+	return server, context, function(name, expected)
+		local conn = client:connect('localhost', port)
+
+		check(name, conn and conn:read(3) == 'hi\n' or false, expected)
+		if conn then conn:close() end
+	end
+end
+
+for _, t in ipairs{
+	{ 'no hosts added', false, function() end },
+	{ 'host added', true, function(context)
+		assert(context:addhost('localhost', dir .. 'cert.pem', dir .. 'key.pem'))
+	end },
+	{ 'host added in upper case', true, function(context)
+		assert(context:addhost('LOCALHOST', dir .. 'cert.pem', dir .. 'key.pem'))
+	end },
+	{ 'other host added', false, function(context)
+		assert(context:addhost('example.com', dir .. 'cert.pem', dir .. 'key.pem'))
+	end },
+	{ 'missing files', false, function(context)
+		assert(context:addhost('localhost', dir .. 'missing.pem'))
+	end },
+} do
+	local name, expected, setup = t[1], t[2], t[3]
+	local server, _, connect = serve(setup)
+
+	-- the second connection uses the loaded certificate
+	connect(name .. ': first connection', expected)
+	connect(name .. ': second connection', expected)
+	server:close()
+end
+
+do
+	local server, context, connect = serve(function(context)
+		assert(context:addhost('localhost', dir .. 'cert.pem', dir .. 'key.pem'))
+	end)
+
+	connect('host replaced: before', true)
+	assert(context:addhost('localhost', dir .. 'othercert.pem',
+		dir .. 'otherkey.pem'))
+	connect('host replaced: after', false)
+	server:close()
+end
+
+test.done()
+
+-- vim: ts=2 sw=2 noet:
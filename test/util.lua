@@ -0,0 +1,118 @@
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+--
+-- Shared helpers for the test scripts, loaded with
+--
+--   local test = dofile(arg[0]:match('^(.-)[^/]*$') .. 'util.lua')
+--
+-- Every script takes the port to listen on as its first argument.
+--
+
+local utils = require 'lem.utils'
+local ssl   = require 'lem.ssl'
+
+local format = string.format
+
+local M = {}
+
+-- directory of the test scripts, where the certificates live
+M.dir = arg[0]:match('^(.-)[^/]*$')
+
+-- port given on the command line or the default of the script
+function M.port(default)
+	return tonumber(arg[1]) or default
+end
+
+-- new context using the self-signed test certificate for localhost
+function M.context()
+	local context = assert(ssl.newcontext())
+
+	assert(context:usecertificate(M.dir .. 'cert.pem', M.dir .. 'key.pem'))
+	return context
+end
+
+local failed = 0
+
+local function show(v)
+	if type(v) == 'string' and #v > 40 then
+		return v:sub(1, 40) .. '...'
+	end
+	return tostring(v)
+end
+
+function M.check(name, got, expected)
+	if got == expected then
+		print('ok   ' .. name)
+	else
+		failed = failed + 1
+		print(format('FAIL %s: got %q, expected %q',
+			name, show(got), show(expected)))
+	end
+end
+
+-- listen on the loopback interface and return the server
+-- and a function connecting to it, which makes the server send
+-- pieces with a pause in between so each arrives in a separate read
+function M.server(context, port)
+	local server = assert(context:listen('127.0.0.1', port))
+
+	local function serve(pieces)
+		utils.spawn(function()
+			local conn = assert(server:accept())
+			local sleeper = utils.sleeper()
+
+			for _, piece in ipairs(pieces) do
+				if not conn:write(piece) then break end
+				sleeper:sleep(0.02)
+			end
+			conn:close()
+		end)
+
+		return assert(context:connect('127.0.0.1', port))
+	end
+
+	return server, serve
+end
+
+-- answer every connection to server with a greeting
+-- until the server is closed
+function M.greet(server, greeting)
+	utils.spawn(function()
+		while true do
+			local conn = server:accept()
+			if not conn then break end
+
+			conn:write(greeting or 'hi\n')
+			conn:close()
+		end
+	end)
+end
+
+-- report the result and exit non-zero if any check failed
+function M.done()
+	if failed > 0 then
+		print(failed .. ' checks failed')
+		os.exit(1)
+	end
+	print 'all checks passed'
+end
+
+return M
+
+-- vim: ts=2 sw=2 noet:
@@ -0,0 +1,130 @@
+#!/usr/bin/env lem
+--
+-- This file is part of lem-ssl.
+-- Copyright 2011 Emil Renner Berthing
+--
+-- lem-ssl is free software: you can redistribute it and/or
+-- modify it under the terms of the GNU General Public License as
+-- published by the Free Software Foundation, either version 3 of
+-- the License, or (at your option) any later version.
+--
+-- lem-ssl is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+--
+
+--
+-- Test context:verify() over the loopback interface, and that
+-- remembered results only skip checks they actually covered.
+--
+-- Usage: test/verify.lua [port]
+--
+
+local ssl = require 'lem.ssl'
+
+local test = dofile(arg[0]:match('^(.-)[^/]*$') .. 'util.lua')
+
+local check = test.check
+local port = test.port(24439)
+local dir = test.dir
+
+-- trust both test certificates
+local cafile = os.tmpname()
+do
+	local out = assert(io.open(cafile, 'w'))
+	for _, name in ipairs{ 'cert.pem', 'othercert.pem' } do
+		local file = assert(io.open(dir .. name))
+		assert(out:write(file:read('*a')))
+		file:close()
+	end
+	out:close()
+end
+
+local function newcontext(cert, key)
+	local context = assert(ssl.newcontext())
+
+	if cert then
+		assert(context:usecertificate(dir .. cert, dir .. key))
+	end
+	return context
+end
+
+-- check whether client gets through to
+-- a server using context at address
+local function connect(name, client, context, address, expected)
+	local server = assert(context:listen('127.0.0.1', port))
+	test.greet(server)
+
+	local conn = client:connect(address, port)
+	check(name, conn and conn:read(3) == 'hi\n' or false, expected)
+	if conn then conn:close() end
+	server:close()
+end
+
+local localhost = newcontext('cert.pem', 'key.pem')
+local other = newcontext('othercert.pem', 'otherkey.pem')
+
+do
+	local client = newcontext()
+	assert(client:verify(cafile))
+
+	connect('matching host', client, localhost, 'localhost', true)
+	connect('matching host again', client, localhost, 'localhost', true)
+	connect('other host', client, other, 'localhost', false)
+	connect('other host again', client, other, 'localhost', false)
+	connect('IP address not in certificate', client, localhost,
+		'127.0.0.1', false)
+end
+
+do
+	local client = newcontext()
+	assert(client:verify(dir .. 'othercert.pem'))
+
+	connect('untrusted certificate', client, localhost, 'localhost', false)
+end
+
+do
+	-- a context both accepting and making connections
+	local both = newcontext('cert.pem', 'key.pem')
+	assert(both:verify(cafile))
+
+	-- as a server it accepts the certificate for other.test
+	-- from a client asking for localhost, which must not
+	-- let that certificate pass for localhost as a client
+	connect('server accepts client certificate',
+		newcontext('othercert.pem', 'otherkey.pem'), both, 'localhost', true)
+	connect('client certificate not reused for host',
+		both, other, 'localhost', false)
+	connect('server accepts client without certificate',
+		newcontext(), both, 'localhost', true)
+end
+
+do
+	local client = newcontext()
+	assert(client:verify(cafile, nil, 0))
+
+	connect('no remembering: matching host', client, localhost,
+		'localhost', true)
+	connect('no remembering: other host', client, other, 'localhost', false)
+end
+
+do
+	local ok, err = pcall(localhost.verify, localhost, cafile, nil, -1)
+
+	check('negative ttl: result', ok, false)
+	check('negative ttl: error',
+		err:find('invalid time to live', 1, true) ~= nil, true)
+
+	ok, err = newcontext():verify(dir .. 'missing.pem')
+	check('missing cafile: result', ok, nil)
+	check('missing cafile: error', type(err), 'string')
+end
+
+os.remove(cafile)
+test.done()
+
+-- vim: ts=2 sw=2 noet:
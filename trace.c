@@ -0,0 +1,118 @@
+/*
+ * This file is part of lem-ssl.
+ * Copyright 2011 Emil Renner Berthing
+ *
+ * lem-ssl is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * lem-ssl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lem-ssl.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * ring buffer of timestamped events
+ *
+ * the buffer is shared by the context and the streams created
+ * while tracing, so it is freed when the last one lets go.
+ * everything runs in the event loop, so no locking is needed
+ */
+static const char *const trace_names[] = {
+	"connect", "resolved", "tcp", "accept", "handshake", "handshaken",
+	"state", "alert", "wantread", "wantwrite", "read", "write",
+	"interrupt", "close", NULL
+};
+
+static struct lem_ssl_trace *
+trace_new(unsigned int size)
+{
+	struct lem_ssl_trace *t;
+
+	t = malloc(sizeof(struct lem_ssl_trace) +
+	           size * sizeof(struct lem_ssl_event));
+	if (t == NULL)
+		return NULL;
+
+	t->refs = 1;
+	t->enabled = 1;
+	t->ids = 0;
+	t->size = size;
+	t->start = t->n = 0;
+	t->lost = 0;
+	return t;
+}
+
+static void
+trace_unref(struct lem_ssl_trace *t)
+{
+	if (--t->refs == 0)
+		free(t);
+}
+
+static void
+trace_record(struct lem_ssl_trace *t, unsigned int stream,
+             int event, int arg)
+{
+	struct lem_ssl_event *e;
+
+	if (!t->enabled)
+		return;
+
+	if (t->n < t->size)
+		e = &t->ev[(t->start + t->n++) % t->size];
+	else {
+		/* full, overwrite the oldest event */
+		e = &t->ev[t->start];
+		t->start = (t->start + 1) % t->size;
+		t->lost++;
+	}
+
+	e->time = ev_time();
+	e->stream = stream;
+	e->event = (unsigned short)event;
+	e->arg = (unsigned short)arg;
+}
+
+static inline void
+stream_trace(struct lem_ssl_stream *s, int event, int arg)
+{
+	if (s->trace != NULL)
+		trace_record(s->trace, s->id, event, arg);
+}
+
+static void
+trace_attach(struct lem_ssl_stream *s, SSL *ssl, struct lem_ssl_trace *t)
+{
+	t->refs++;
+	s->trace = t;
+	s->id = ++t->ids;
+	SSL_set_app_data(ssl, s);
+}
+
+/*
+ * move the recorded events to a string
+ */
+static void
+trace_push(lua_State *T, struct lem_ssl_trace *t)
+{
+	luaL_Buffer b;
+	unsigned int first = t->size - t->start;
+
+	if (first > t->n)
+		first = t->n;
+
+	luaL_buffinit(T, &b);
+	luaL_addlstring(&b, (const char *)&t->ev[t->start],
+	                first * sizeof(struct lem_ssl_event));
+	luaL_addlstring(&b, (const char *)t->ev,
+	                (t->n - first) * sizeof(struct lem_ssl_event));
+	luaL_pushresult(&b);
+
+	t->start = t->n = 0;
+}